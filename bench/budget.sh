@@ -0,0 +1,69 @@
+#!/bin/sh
+# Check that single changes to a window cost no more X requests per frame
+# than bench/budgets allows, on a private Xvfb display. Exits with 1 when a
+# budget is exceeded or has not been recorded. With "record", bench/budgets
+# is rewritten with the measured costs plus 10% instead.
+
+set -e
+cd "$(dirname "$0")/.."
+
+display=${BENCH_DISPLAY:-:99}
+record=$1
+log=$(mktemp)
+new=$(mktemp)
+trap 'rm -f "$log" "$new"' EXIT
+
+grep '^#' bench/budgets >"$new"
+grep -v '^#' bench/budgets | while read -r scenario options budget; do
+  [ "$options" = - ] && options=
+
+  Xvfb "$display" -screen 0 1920x1080x24 -nolisten tcp >/dev/null 2>&1 &
+  xvfb=$!
+  sleep 1
+  # shellcheck disable=SC2086
+  DISPLAY=$display ./diagonator $options --stats 1 2>"$log" &
+  diagonator=$!
+  sleep 1
+  # the workload makes its change two seconds in and then keeps its windows
+  # until it is killed, so closing them is never measured
+  DISPLAY=$display ./bench/workload "$scenario" 5 60 &
+  workload=$!
+  sleep 5
+  kill $diagonator 2>/dev/null || true
+  wait $diagonator 2>/dev/null || true
+  kill $workload $xvfb 2>/dev/null || true
+  wait 2>/dev/null || true
+
+  # nothing changes after the change, so the last report with frames in it
+  # covers it
+  cost=$(awk '/^stats/ {
+    for (i = 2; i <= NF; i++) {
+      split($i, kv, "=")
+      s[kv[1]] = kv[2]
+    }
+    if (s["frames"] > 0)
+      cost = s["requests_per_frame"]
+  } END { print cost + 0 }' "$log")
+
+  if [ "$record" = record ]; then
+    budget=$(awk -v c="$cost" 'BEGIN { b = c * 1.1; print (b == int(b)) ? b : int(b) + 1 }')
+    printf '%-13s %-21s %s\n' "$scenario" "${options:--}" "$budget" >>"$new"
+    echo "scenario=$scenario requests_per_frame=$cost budget=$budget"
+  elif [ "$budget" = - ]; then
+    echo "scenario=$scenario requests_per_frame=$cost budget=none FAILED"
+    echo failed >>"$new.failed"
+  elif awk -v c="$cost" -v b="$budget" 'BEGIN { exit !(c > b) }'; then
+    echo "scenario=$scenario requests_per_frame=$cost budget=$budget FAILED"
+    echo failed >>"$new.failed"
+  else
+    echo "scenario=$scenario requests_per_frame=$cost budget=$budget"
+  fi
+done
+
+if [ "$record" = record ]; then
+  cp "$new" bench/budgets
+fi
+if [ -f "$new.failed" ]; then
+  rm -f "$new.failed"
+  exit 1
+fi
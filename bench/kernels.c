@@ -0,0 +1,149 @@
+/*
+ * CPU benchmark of the kernels in kernels.c, without an X server. Prints one
+ * line of key=value results per kernel and parameter set.
+ *
+ * usage: kernels [seconds per case]
+ */
+
+#include "kernels.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double min_seconds = 0.2;
+/* results are summed into this so that the calls are not optimized away */
+static volatile unsigned long sink;
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef unsigned long (*kernel)(void *arg);
+
+/* Run k often enough to take min_seconds and print its cost, where bytes is
+ * how much it produces per call */
+static void run(const char *name, const char *params, kernel k, void *arg,
+                unsigned long bytes) {
+  unsigned long calls = 0, n = 1, i;
+  double start = now(), elapsed;
+
+  do {
+    for (i = 0; i < n; i++)
+      sink += k(arg);
+    calls += n;
+    n *= 2;
+    elapsed = now() - start;
+  } while (elapsed < min_seconds);
+  printf("kernel=%s %s ns_per_call=%.1f bytes_per_s=%.0f\n", name, params,
+         elapsed * 1e9 / calls, bytes * calls / elapsed);
+}
+
+typedef struct {
+  double radius;
+  conv *map;
+  shadow_tables *tables;
+  int width, height;
+  double direction, spacing;
+  XSegment *lines;
+} bench_args;
+
+static unsigned long bench_gaussian_map(void *arg) {
+  bench_args *a = arg;
+  conv *map = make_gaussian_map(a->radius);
+  unsigned long size = map->size;
+
+  free(map);
+  return size;
+}
+
+static unsigned long bench_presum(void *arg) {
+  bench_args *a = arg;
+
+  free_shadow_tables(presum_gaussian(a->map));
+  return 1;
+}
+
+static unsigned long bench_sum_gaussian(void *arg) {
+  bench_args *a = arg;
+
+  return sum_gaussian(a->map, 0.75, 0, 0, a->width, a->height);
+}
+
+static unsigned long bench_shadow(void *arg) {
+  bench_args *a = arg;
+  int swidth, sheight;
+  unsigned char *data =
+      make_shadow_data(a->tables, 0.75, a->width, a->height, &swidth, &sheight);
+  unsigned long v = data ? data[0] : 0;
+
+  free(data);
+  return v;
+}
+
+static unsigned long bench_segments(void *arg) {
+  bench_args *a = arg;
+
+  diagonal_segments(a->direction, a->spacing, a->width, a->height, a->lines);
+  return a->lines[0].x1;
+}
+
+int main(int argc, char **argv) {
+  static const double radii[] = {4, 12, 24};
+  static const int sizes[][2] = {{64, 64}, {512, 512}, {1920, 1080},
+                                 {3840, 2160}};
+  static const double spacings[] = {10, 50, 200};
+  static const double directions[] = {30, 45, 60, 135};
+  bench_args a;
+  char params[128];
+  unsigned int r, s, p, d;
+
+  if (argc > 1)
+    min_seconds = atof(argv[1]);
+
+  for (r = 0; r < sizeof(radii) / sizeof(radii[0]); r++) {
+    a.radius = radii[r];
+    a.map = make_gaussian_map(a.radius);
+    a.tables = presum_gaussian(a.map);
+    if (!a.tables)
+      return 1;
+    snprintf(params, sizeof(params), "radius=%g", a.radius);
+    run("make_gaussian_map", params, bench_gaussian_map, &a,
+        a.map->size * a.map->size * sizeof(double));
+    run("presum_gaussian", params, bench_presum, &a,
+        (a.map->size + 1) * (a.map->size + 2) * 26);
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+      a.width = sizes[s][0];
+      a.height = sizes[s][1];
+      snprintf(params, sizeof(params), "radius=%g width=%d height=%d",
+               a.radius, a.width, a.height);
+      run("sum_gaussian", params, bench_sum_gaussian, &a, 1);
+      run("make_shadow_data", params, bench_shadow, &a,
+          (unsigned long)(a.width + a.map->size) * (a.height + a.map->size));
+    }
+    free_shadow_tables(a.tables);
+    free(a.map);
+  }
+
+  a.width = 1920;
+  a.height = 1080;
+  for (p = 0; p < sizeof(spacings) / sizeof(spacings[0]); p++)
+    for (d = 0; d < sizeof(directions) / sizeof(directions[0]); d++) {
+      int n;
+      a.spacing = spacings[p];
+      a.direction = directions[d];
+      n = diagonal_segment_count(a.direction, a.spacing, a.width, a.height);
+      a.lines = malloc(n * sizeof(XSegment));
+      if (!a.lines)
+        return 1;
+      snprintf(params, sizeof(params),
+               "spacing=%g direction=%g width=%d height=%d", a.spacing,
+               a.direction, a.width, a.height);
+      run("diagonal_segments", params, bench_segments, &a,
+          n * sizeof(XSegment));
+      free(a.lines);
+    }
+  return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * Test client for diagonator --latency: draws into a window at a steady
+ * rate, stamping each frame with the time it was drawn in the
+ * _DIAGONATOR_LATENCY_STAMP property of the window, so that diagonator can
+ * tell how long the drawing took to reach the screen.
+ *
+ * usage: latency seconds [frames per second]
+ *
+ * The window is override-redirect so that the stamp is on the top-level
+ * window diagonator sees, even with a window manager running.
+ */
+
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LATENCY_PROP "_DIAGONATOR_LATENCY_STAMP"
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int main(int argc, char **argv) {
+  Display *dpy;
+  Window w;
+  XSetWindowAttributes attr;
+  GC gc;
+  Atom stampAtom;
+  double seconds, fps = 60;
+  uint64_t start, next;
+  unsigned long frames = 0;
+
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "usage: %s seconds [frames per second]\n", argv[0]);
+    return 1;
+  }
+  seconds = atof(argv[1]);
+  if (argc == 3)
+    fps = atof(argv[2]);
+  if (fps <= 0)
+    fps = 60;
+
+  dpy = XOpenDisplay(NULL);
+  if (!dpy) {
+    fprintf(stderr, "Can't open display\n");
+    return 1;
+  }
+  stampAtom = XInternAtom(dpy, LATENCY_PROP, False);
+  attr.override_redirect = True;
+  attr.background_pixel = BlackPixel(dpy, DefaultScreen(dpy));
+  w = XCreateWindow(dpy, DefaultRootWindow(dpy), 100, 100, 256, 256, 0,
+                    CopyFromParent, InputOutput, CopyFromParent,
+                    CWOverrideRedirect | CWBackPixel, &attr);
+  gc = XCreateGC(dpy, w, 0, NULL);
+  XMapWindow(dpy, w);
+  XSync(dpy, False);
+  sleep(1);
+
+  start = next = now_us();
+  while (next - start < seconds * 1e6) {
+    uint64_t stamp = now_us();
+    /* format 32 property data is passed as longs */
+    long halves[2] = {(long)(stamp >> 32), (long)(stamp & 0xffffffff)};
+
+    /* the stamp goes first, so diagonator has it when the damage arrives */
+    XChangeProperty(dpy, w, stampAtom, XA_CARDINAL, 32, PropModeReplace,
+                    (unsigned char *)halves, 2);
+    XSetForeground(dpy, gc, frames & 1 ? 0xffffff : 0x404040);
+    XFillRectangle(dpy, w, gc, 0, 0, 256, 256);
+    XFlush(dpy);
+    frames++;
+    next += 1e6 / fps;
+    stamp = now_us();
+    if (next > stamp)
+      usleep(next - stamp);
+  }
+  printf("frames=%lu\n", frames);
+
+  XFreeGC(dpy, gc);
+  XCloseDisplay(dpy);
+  return 0;
+}
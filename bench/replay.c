@@ -0,0 +1,233 @@
+/*
+ * Play back a file written by diagonator --record on the display in
+ * $DISPLAY, normally a private Xvfb with diagonator running on it. Every
+ * recorded window gets a stand-in window that is created, moved, restacked,
+ * mapped, drawn into and reshaped the same way, so diagonator sees the same
+ * events again.
+ *
+ * usage: replay file [max]
+ *
+ * With max the events are played back as fast as possible instead of at the
+ * recorded times.
+ */
+
+#include "record.h"
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/shape.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OPACITY_PROP "_NET_WM_WINDOW_OPACITY"
+
+typedef struct _stand_in {
+  uint32_t recorded;
+  Window window;
+} stand_in;
+
+static stand_in *stand_ins;
+static int n_stand_ins, size_stand_ins;
+
+static Window find_stand_in(uint32_t recorded) {
+  int i;
+
+  for (i = n_stand_ins - 1; i >= 0; i--)
+    if (stand_ins[i].recorded == recorded)
+      return stand_ins[i].window;
+  return None;
+}
+
+static void add_stand_in(uint32_t recorded, Window window) {
+  if (n_stand_ins == size_stand_ins) {
+    size_stand_ins = size_stand_ins ? size_stand_ins * 2 : 64;
+    stand_ins = realloc(stand_ins, size_stand_ins * sizeof(stand_in));
+    if (!stand_ins)
+      exit(1);
+  }
+  stand_ins[n_stand_ins].recorded = recorded;
+  stand_ins[n_stand_ins].window = window;
+  n_stand_ins++;
+}
+
+static void remove_stand_in(uint32_t recorded) {
+  int i;
+
+  for (i = 0; i < n_stand_ins; i++)
+    if (stand_ins[i].recorded == recorded) {
+      stand_ins[i] = stand_ins[--n_stand_ins];
+      return;
+    }
+}
+
+static Window create_stand_in(Display *dpy, const record *r) {
+  XSetWindowAttributes attr;
+  Window w;
+
+  attr.override_redirect = r->flag;
+  attr.background_pixel = 0x404040 + rand() % 0x808080;
+  w = XCreateWindow(dpy, DefaultRootWindow(dpy), r->x, r->y,
+                    r->width ? r->width : 1, r->height ? r->height : 1,
+                    r->border_width, CopyFromParent, InputOutput,
+                    CopyFromParent, CWOverrideRedirect | CWBackPixel, &attr);
+  add_stand_in(r->window, w);
+  return w;
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void play(Display *dpy, GC gc, Atom opacityAtom, const record *r) {
+  Window w = find_stand_in(r->window);
+
+  if (!w && r->type != CreateNotify && r->type != ReparentNotify &&
+      r->type != Expose)
+    return;
+  switch (r->type) {
+  case CreateNotify:
+    create_stand_in(dpy, r);
+    break;
+  case ConfigureNotify: {
+    XWindowChanges wc;
+    unsigned int mask = CWX | CWY | CWWidth | CWHeight | CWBorderWidth |
+                        CWStackMode;
+    wc.x = r->x;
+    wc.y = r->y;
+    wc.width = r->width ? r->width : 1;
+    wc.height = r->height ? r->height : 1;
+    wc.border_width = r->border_width;
+    wc.sibling = find_stand_in(r->sibling);
+    wc.stack_mode = wc.sibling ? Above : Below;
+    if (wc.sibling)
+      mask |= CWSibling;
+    XConfigureWindow(dpy, w, mask, &wc);
+    break;
+  }
+  case DestroyNotify:
+    XDestroyWindow(dpy, w);
+    remove_stand_in(r->window);
+    break;
+  case MapNotify:
+    XMapWindow(dpy, w);
+    break;
+  case UnmapNotify:
+    XUnmapWindow(dpy, w);
+    break;
+  case ReparentNotify:
+    /* moving into a frame looks like a destroy to the compositor, and out
+     * of one like a create */
+    if (w) {
+      XDestroyWindow(dpy, w);
+      remove_stand_in(r->window);
+    } else {
+      record c = *r;
+      c.width = c.height = 100;
+      create_stand_in(dpy, &c);
+    }
+    break;
+  case CirculateNotify:
+    if (r->flag == PlaceOnTop)
+      XRaiseWindow(dpy, w);
+    else
+      XLowerWindow(dpy, w);
+    break;
+  case Expose:
+    XClearArea(dpy, DefaultRootWindow(dpy), r->x, r->y, r->width, r->height,
+               True);
+    break;
+  case PropertyNotify: {
+    unsigned long opacity = r->value;
+    XChangeProperty(dpy, w, opacityAtom, XA_CARDINAL, 32, PropModeReplace,
+                    (unsigned char *)&opacity, 1);
+    break;
+  }
+  case RecordDamage:
+    XSetForeground(dpy, gc, rand() & 0xffffff);
+    XFillRectangle(dpy, w, gc, r->x, r->y, r->width, r->height);
+    break;
+  case RecordShape:
+    if (r->flag) {
+      XRectangle rect;
+      rect.x = r->x;
+      rect.y = r->y;
+      rect.width = r->width;
+      rect.height = r->height;
+      XShapeCombineRectangles(dpy, w, ShapeBounding, 0, 0, &rect, 1, ShapeSet,
+                              Unsorted);
+    } else
+      XShapeCombineMask(dpy, w, ShapeBounding, 0, 0, None, ShapeSet);
+    break;
+  }
+}
+
+static int ignore_errors(Display *dpy, XErrorEvent *ev) { return 0; }
+
+int main(int argc, char **argv) {
+  Display *dpy;
+  FILE *file;
+  record_header h;
+  record r;
+  GC gc;
+  Atom opacityAtom;
+  int max_speed;
+  unsigned long n = 0;
+  double start, elapsed;
+
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "usage: %s file [max]\n", argv[0]);
+    return 1;
+  }
+  max_speed = argc == 3 && !strcmp(argv[2], "max");
+  file = fopen(argv[1], "rb");
+  if (!file) {
+    perror(argv[1]);
+    return 1;
+  }
+  if (fread(&h, sizeof(h), 1, file) != 1 || h.magic != RECORD_MAGIC ||
+      h.version != RECORD_VERSION || h.record_size != sizeof(record)) {
+    fprintf(stderr, "%s: not a diagonator recording\n", argv[1]);
+    return 1;
+  }
+
+  dpy = XOpenDisplay(NULL);
+  if (!dpy) {
+    fprintf(stderr, "Can't open display\n");
+    return 1;
+  }
+  /* recorded windows may have been gone before some of their events */
+  XSetErrorHandler(ignore_errors);
+  if (DisplayWidth(dpy, DefaultScreen(dpy)) != h.root_width ||
+      DisplayHeight(dpy, DefaultScreen(dpy)) != h.root_height)
+    fprintf(stderr, "recorded on a %dx%d screen\n", h.root_width,
+            h.root_height);
+  opacityAtom = XInternAtom(dpy, OPACITY_PROP, False);
+  gc = XCreateGC(dpy, DefaultRootWindow(dpy), 0, NULL);
+
+  start = now();
+  while (fread(&r, sizeof(r), 1, file) == 1) {
+    if (!max_speed) {
+      double wait = r.time / 1000.0 - (now() - start);
+      if (wait > 0) {
+        XFlush(dpy);
+        usleep(wait * 1e6);
+      }
+    }
+    play(dpy, gc, opacityAtom, &r);
+    n++;
+  }
+  XSync(dpy, False);
+  elapsed = now() - start;
+  printf("events=%lu seconds=%.3f events_per_s=%.1f\n", n, elapsed,
+         elapsed > 0 ? n / elapsed : 0);
+
+  XFreeGC(dpy, gc);
+  XCloseDisplay(dpy);
+  fclose(file);
+  return 0;
+}
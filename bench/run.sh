@@ -0,0 +1,104 @@
+#!/bin/sh
+# Run diagonator on a private Xvfb display under each workload of
+# bench/workload and print one line of key=value results per workload.
+#
+# BENCH_DISPLAY, BENCH_SECONDS, BENCH_WINDOWS and BENCH_CLIENTS override the
+# display, the length of each run, the number of windows and the number of
+# clients sending damage at once. BENCH_REPLAY names a file recorded with
+# diagonator --record to play back as one more workload. Extra arguments are
+# passed to diagonator.
+
+set -e
+cd "$(dirname "$0")/.."
+
+display=${BENCH_DISPLAY:-:99}
+seconds=${BENCH_SECONDS:-10}
+windows=${BENCH_WINDOWS:-20}
+clients=${BENCH_CLIENTS:-4}
+log=$(mktemp)
+trap 'rm -f "$log"' EXIT
+
+# user and system CPU time of a process, in seconds
+cpu_seconds() {
+  awk -v hz="$(getconf CLK_TCK)" '{ print ($14 + $15) / hz }' \
+    "/proc/$1/stat" 2>/dev/null || echo 0
+}
+
+# run name "diagonator options" workload arguments...
+run() {
+  name=$1
+  options=$2
+  shift 2
+
+  Xvfb "$display" -screen 0 1920x1080x24 -nolisten tcp >/dev/null 2>&1 &
+  xvfb=$!
+  sleep 1
+
+  # The workload starts first and outlasts the single stats report, so
+  # the report covers nothing but the workload running. It ends when the
+  # display goes away.
+  length=$((seconds * 2 + 10))
+  case $name in
+  damage)
+    i=0
+    while [ $i -lt "$clients" ]; do
+      DISPLAY=$display ./bench/workload damage 5 "$length" &
+      i=$((i + 1))
+    done
+    ;;
+  resize)
+    DISPLAY=$display ./bench/workload resize 1 "$length" &
+    ;;
+  replay)
+    DISPLAY=$display ./bench/replay "$BENCH_REPLAY" >/dev/null &
+    ;;
+  latency)
+    DISPLAY=$display ./bench/latency "$length" >/dev/null &
+    ;;
+  *)
+    DISPLAY=$display ./bench/workload "$name" "$windows" "$length" &
+    ;;
+  esac
+  sleep 1
+  # shellcheck disable=SC2086
+  DISPLAY=$display ./diagonator $options "$@" --stats "$seconds" 2>"$log" &
+  diagonator=$!
+  wait_start=$(date +%s)
+  while ! grep -q '^stats' "$log" &&
+    [ $(($(date +%s) - wait_start)) -lt $((seconds * 2 + 5)) ]; do
+    sleep 1
+  done
+
+  diagonator_cpu=$(cpu_seconds $diagonator)
+  xvfb_cpu=$(cpu_seconds $xvfb)
+  kill $diagonator $xvfb 2>/dev/null || true
+  wait 2>/dev/null || true
+
+  grep -m 1 '^stats' "$log" | awk -v name="$name" \
+    -v diagonator_cpu="$diagonator_cpu" -v xvfb_cpu="$xvfb_cpu" '{
+    for (i = 2; i <= NF; i++) {
+      split($i, kv, "=")
+      s[kv[1]] = kv[2]
+    }
+    printf "workload=%s frames_per_s=%.1f paint_us_p50=%s paint_us_p99=%s " \
+           "requests_per_frame=%s diagonator_cpu_s=%s xvfb_cpu_s=%s",
+           name, s["frames"] * 1000 / s["interval_ms"], s["paint_us_p50"],
+           s["paint_us_p99"], s["requests_per_frame"], diagonator_cpu,
+           xvfb_cpu
+    if ("draw_latency_us_p50" in s)
+      printf " draw_latency_us_p50=%s draw_latency_us_p99=%s " \
+             "draw_latency_us_max=%s", s["draw_latency_us_p50"],
+             s["draw_latency_us_p99"], s["draw_latency_us_max"]
+    printf "\n"
+  }'
+}
+
+run static "" "$@"
+run damage "" "$@"
+run resize "" "$@"
+run mapunmap "" "$@"
+run fade "-c -f" "$@"
+run latency "--latency" "$@"
+if [ -n "$BENCH_REPLAY" ]; then
+  run replay "" "$@"
+fi
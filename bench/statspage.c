@@ -0,0 +1,76 @@
+/*
+ * Print the counters of a page written by diagonator --stats-page as one
+ * line of key=value pairs, once or at an interval.
+ *
+ * usage: statspage file [seconds]
+ */
+
+#include "stats.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static void print_counters(const stats_counters *c) {
+  int i;
+
+  printf("frames=%llu damage_events=%llu damage_rects=%llu damage_area=%llu "
+         "round_trips=%llu windows=%u mapped_windows=%u fades=%u "
+         "live_pictures=%d live_pixmaps=%d live_regions=%d live_damages=%d "
+         "cpu_s=%.3f updated_ms=%llu",
+         (unsigned long long)c->frames, (unsigned long long)c->damage_events,
+         (unsigned long long)c->damage_rects,
+         (unsigned long long)c->damage_area,
+         (unsigned long long)c->round_trips, c->windows, c->mapped_windows,
+         c->fades, c->live_pictures, c->live_pixmaps, c->live_regions,
+         c->live_damages, c->cpu_seconds, (unsigned long long)c->updated_ms);
+  printf(" events=");
+  for (i = 0; i < STATS_EVENT_TYPES; i++)
+    if (c->events[i])
+      printf("%d:%llu,", i, (unsigned long long)c->events[i]);
+  printf(" paint_us=");
+  for (i = 0; i < STATS_PAINT_BUCKETS; i++)
+    printf("%s%llu", i ? "," : "", (unsigned long long)c->paint_us[i]);
+  putchar('\n');
+  fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+  const stats_page *page;
+  stats_counters c;
+  double seconds = 0;
+  int fd;
+
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "usage: %s file [seconds]\n", argv[0]);
+    return 1;
+  }
+  if (argc == 3)
+    seconds = atof(argv[2]);
+  fd = open(argv[1], O_RDONLY);
+  if (fd < 0) {
+    perror(argv[1]);
+    return 1;
+  }
+  page = mmap(NULL, sizeof(stats_page), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (page == MAP_FAILED) {
+    perror(argv[1]);
+    return 1;
+  }
+  if (page->magic != DIAGONATOR_STATS_MAGIC ||
+      page->version != DIAGONATOR_STATS_VERSION ||
+      page->size != sizeof(stats_page)) {
+    fprintf(stderr, "%s: not a diagonator stats page of this version\n",
+            argv[1]);
+    return 1;
+  }
+  for (;;) {
+    stats_page_read(page, &c);
+    print_counters(&c);
+    if (seconds <= 0)
+      return 0;
+    usleep(seconds * 1e6);
+  }
+}
@@ -0,0 +1,132 @@
+/*
+ * Window churn for benchmarking diagonator: creates windows on the display
+ * in $DISPLAY and keeps changing them for a given number of seconds.
+ *
+ * usage: workload static|damage|resize|mapunmap|fade windows seconds
+ *
+ * The one-damage, one-move and one-fade modes instead wait two seconds, make
+ * a single change to the first window and wait for the rest of the time, to
+ * measure what one such change costs.
+ */
+
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OPACITY_PROP "_NET_WM_WINDOW_OPACITY"
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void set_opacity(Display *dpy, Window w, Atom atom,
+                        unsigned long opacity) {
+  XChangeProperty(dpy, w, atom, XA_CARDINAL, 32, PropModeReplace,
+                  (unsigned char *)&opacity, 1);
+}
+
+int main(int argc, char **argv) {
+  Display *dpy;
+  Window *windows;
+  GC gc;
+  Atom opacityAtom;
+  const char *mode;
+  int n, i, step;
+  double seconds, start;
+  int screen_width, screen_height;
+
+  if (argc != 4) {
+    fprintf(stderr,
+            "usage: %s static|damage|resize|mapunmap|fade|one-damage|one-move|"
+            "one-fade windows seconds\n",
+            argv[0]);
+    return 1;
+  }
+  mode = argv[1];
+  n = atoi(argv[2]);
+  seconds = atof(argv[3]);
+  if (n <= 0)
+    n = 1;
+
+  dpy = XOpenDisplay(NULL);
+  if (!dpy) {
+    fprintf(stderr, "Can't open display\n");
+    return 1;
+  }
+  screen_width = DisplayWidth(dpy, DefaultScreen(dpy));
+  screen_height = DisplayHeight(dpy, DefaultScreen(dpy));
+  opacityAtom = XInternAtom(dpy, OPACITY_PROP, False);
+
+  windows = malloc(n * sizeof(Window));
+  if (!windows)
+    return 1;
+  srand(getpid());
+  for (i = 0; i < n; i++) {
+    int width = 100 + rand() % 400, height = 100 + rand() % 300;
+    windows[i] = XCreateSimpleWindow(
+        dpy, DefaultRootWindow(dpy), rand() % (screen_width - width),
+        rand() % (screen_height - height), width, height, 0, 0,
+        0x404040 + rand() % 0x808080);
+    XMapWindow(dpy, windows[i]);
+  }
+  gc = XCreateGC(dpy, windows[0], 0, NULL);
+  XSync(dpy, False);
+
+  start = now();
+  if (!strncmp(mode, "one-", 4)) {
+    sleep(2);
+    if (!strcmp(mode, "one-damage"))
+      XFillRectangle(dpy, windows[0], gc, 10, 10, 16, 12);
+    else if (!strcmp(mode, "one-move"))
+      XMoveWindow(dpy, windows[0], 10, 10);
+    else if (!strcmp(mode, "one-fade"))
+      set_opacity(dpy, windows[0], opacityAtom, 0x7fffffffUL);
+    XFlush(dpy);
+    while (now() - start < seconds)
+      usleep(100000);
+  }
+  for (step = 0; now() - start < seconds; step++) {
+    if (!strcmp(mode, "damage")) {
+      /* small updates all over, like text being typed */
+      for (i = 0; i < n; i++) {
+        XSetForeground(dpy, gc, rand() & 0xffffff);
+        XFillRectangle(dpy, windows[i], gc, rand() % 90, rand() % 90,
+                       8 + rand() % 16, 12);
+      }
+      usleep(5000);
+    } else if (!strcmp(mode, "resize")) {
+      /* an interactive resize drag */
+      XResizeWindow(dpy, windows[0], 200 + step % 400, 150 + step % 300);
+      usleep(2000);
+    } else if (!strcmp(mode, "mapunmap")) {
+      /* switching workspaces back and forth */
+      for (i = 0; i < n; i++) {
+        if (step % 2)
+          XMapWindow(dpy, windows[i]);
+        else
+          XUnmapWindow(dpy, windows[i]);
+      }
+      usleep(100000);
+    } else if (!strcmp(mode, "fade")) {
+      for (i = 0; i < n; i++)
+        set_opacity(dpy, windows[i], opacityAtom,
+                    step % 2 ? 0xffffffffUL : 0x7fffffffUL);
+      usleep(500000);
+    } else {
+      usleep(100000);
+    }
+    XFlush(dpy);
+  }
+
+  XFreeGC(dpy, gc);
+  XCloseDisplay(dpy);
+  free(windows);
+  return 0;
+}
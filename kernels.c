@@ -0,0 +1,318 @@
+/*
+ * Copyright © 2003 Keith Packard
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of Keith Packard not be used in
+ * advertising or publicity pertaining to distribution of the software without
+ * specific, written prior permission.  Keith Packard makes no
+ * representations about the suitability of this software for any purpose.  It
+ * is provided "as is" without express or implied warranty.
+ *
+ * KEITH PACKARD DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL KEITH PACKARD BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* The parts of diagonator that only compute, without talking to the X
+ * server: the gaussian shadows and the geometry of the lines.
+ */
+
+#include "kernels.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static double gaussian(double r, double x, double y) {
+  return ((1 / (sqrt(2 * M_PI * r))) * exp((-(x * x + y * y)) / (2 * r * r)));
+}
+
+conv *make_gaussian_map(double r) {
+  conv *c;
+  int size = ((int)ceil((r * 3)) + 1) & ~1;
+  int center = size / 2;
+  int x, y;
+  double t;
+  double g;
+
+  c = malloc(sizeof(conv) + size * size * sizeof(double));
+  c->size = size;
+  c->data = (double *)(c + 1);
+  t = 0.0;
+  for (y = 0; y < size; y++)
+    for (x = 0; x < size; x++) {
+      g = gaussian(r, (double)(x - center), (double)(y - center));
+      t += g;
+      c->data[y * size + x] = g;
+    }
+  /*    printf ("gaussian total %f\n", t); */
+  for (y = 0; y < size; y++)
+    for (x = 0; x < size; x++) {
+      c->data[y * size + x] /= t;
+    }
+  return c;
+}
+
+/*
+ * A picture will help
+ *
+ *	-center   0                width  width+center
+ *  -center +-----+-------------------+-----+
+ *	    |     |                   |     |
+ *	    |     |                   |     |
+ *        0 +-----+-------------------+-----+
+ *	    |     |                   |     |
+ *	    |     |                   |     |
+ *	    |     |                   |     |
+ *   height +-----+-------------------+-----+
+ *	    |     |                   |     |
+ * height+  |     |                   |     |
+ *  center  +-----+-------------------+-----+
+ */
+
+unsigned char sum_gaussian(conv *map, double opacity, int x, int y, int width,
+                           int height) {
+  int fx, fy;
+  double *g_data;
+  double *g_line = map->data;
+  int g_size = map->size;
+  int center = g_size / 2;
+  int fx_start, fx_end;
+  int fy_start, fy_end;
+  double v;
+
+  /*
+   * Compute set of filter values which are "in range",
+   * that's the set with:
+   *	0 <= x + (fx-center) && x + (fx-center) < width &&
+   *  0 <= y + (fy-center) && y + (fy-center) < height
+   *
+   *  0 <= x + (fx - center)	x + fx - center < width
+   *  center - x <= fx	fx < width + center - x
+   */
+
+  fx_start = center - x;
+  if (fx_start < 0)
+    fx_start = 0;
+  fx_end = width + center - x;
+  if (fx_end > g_size)
+    fx_end = g_size;
+
+  fy_start = center - y;
+  if (fy_start < 0)
+    fy_start = 0;
+  fy_end = height + center - y;
+  if (fy_end > g_size)
+    fy_end = g_size;
+
+  g_line = g_line + fy_start * g_size + fx_start;
+
+  v = 0;
+  for (fy = fy_start; fy < fy_end; fy++) {
+    g_data = g_line;
+    g_line += g_size;
+
+    for (fx = fx_start; fx < fx_end; fx++)
+      v += *g_data++;
+  }
+  if (v > 1)
+    v = 1;
+
+  return ((unsigned char)(v * opacity * 255.0));
+}
+
+/* precompute shadow corners and sides to save time for large windows */
+shadow_tables *presum_gaussian(conv *map) {
+  int center = map->size / 2;
+  int size = map->size;
+  int opacity, x, y;
+  shadow_tables *t = malloc(sizeof(shadow_tables));
+  unsigned char *corner, *top;
+
+  if (!t)
+    return NULL;
+  corner = malloc((size + 1) * (size + 1) * 26);
+  top = malloc((size + 1) * 26);
+  if (!corner || !top) {
+    free(corner);
+    free(top);
+    free(t);
+    return NULL;
+  }
+  t->map = map;
+  t->corner = corner;
+  t->top = top;
+
+  for (x = 0; x <= size; x++) {
+    top[25 * (size + 1) + x] =
+        sum_gaussian(map, 1, x - center, center, size * 2, size * 2);
+    for (opacity = 0; opacity < 25; opacity++)
+      top[opacity * (size + 1) + x] = top[25 * (size + 1) + x] * opacity / 25;
+    for (y = 0; y <= x; y++) {
+      corner[25 * (size + 1) * (size + 1) + y * (size + 1) + x] =
+          sum_gaussian(map, 1, x - center, y - center, size * 2, size * 2);
+      corner[25 * (size + 1) * (size + 1) + x * (size + 1) + y] =
+          corner[25 * (size + 1) * (size + 1) + y * (size + 1) + x];
+      for (opacity = 0; opacity < 25; opacity++)
+        corner[opacity * (size + 1) * (size + 1) + y * (size + 1) + x] =
+            corner[opacity * (size + 1) * (size + 1) + x * (size + 1) + y] =
+                corner[25 * (size + 1) * (size + 1) + y * (size + 1) + x] *
+                opacity / 25;
+    }
+  }
+  return t;
+}
+
+void free_shadow_tables(shadow_tables *t) {
+  if (!t)
+    return;
+  free(t->corner);
+  free(t->top);
+  free(t);
+}
+
+unsigned char *make_shadow_data(const shadow_tables *t, double opacity,
+                                int width, int height, int *swp, int *shp) {
+  conv *map = t->map;
+  unsigned char *data;
+  int gsize = map->size;
+  int ylimit, xlimit;
+  int swidth = width + gsize;
+  int sheight = height + gsize;
+  int center = gsize / 2;
+  int x, y;
+  unsigned char d;
+  int x_diff;
+  int opacity_int = (int)(opacity * 25);
+  data = malloc(swidth * sheight * sizeof(unsigned char));
+  if (!data)
+    return NULL;
+  *swp = swidth;
+  *shp = sheight;
+  /*
+   * Build the gaussian in sections
+   */
+
+  /*
+   * center (fill the complete data array)
+   */
+  if (gsize > 0)
+    d = t->top[opacity_int * (gsize + 1) + gsize];
+  else
+    d = sum_gaussian(map, opacity, center, center, width, height);
+  memset(data, d, sheight * swidth);
+
+  /*
+   * corners
+   */
+  ylimit = gsize;
+  if (ylimit > sheight / 2)
+    ylimit = (sheight + 1) / 2;
+  xlimit = gsize;
+  if (xlimit > swidth / 2)
+    xlimit = (swidth + 1) / 2;
+
+  for (y = 0; y < ylimit; y++)
+    for (x = 0; x < xlimit; x++) {
+      if (xlimit == gsize && ylimit == gsize)
+        d = t->corner[opacity_int * (gsize + 1) * (gsize + 1) +
+                      y * (gsize + 1) + x];
+      else
+        d = sum_gaussian(map, opacity, x - center, y - center, width,
+                         height);
+      data[y * swidth + x] = d;
+      data[(sheight - y - 1) * swidth + x] = d;
+      data[(sheight - y - 1) * swidth + (swidth - x - 1)] = d;
+      data[y * swidth + (swidth - x - 1)] = d;
+    }
+
+  /*
+   * top/bottom
+   */
+  x_diff = swidth - (gsize * 2);
+  if (x_diff > 0 && ylimit > 0) {
+    for (y = 0; y < ylimit; y++) {
+      if (ylimit == gsize)
+        d = t->top[opacity_int * (gsize + 1) + y];
+      else
+        d = sum_gaussian(map, opacity, center, y - center, width,
+                         height);
+      memset(&data[y * swidth + gsize], d, x_diff);
+      memset(&data[(sheight - y - 1) * swidth + gsize], d, x_diff);
+    }
+  }
+
+  /*
+   * sides
+   */
+
+  for (x = 0; x < xlimit; x++) {
+    if (xlimit == gsize)
+      d = t->top[opacity_int * (gsize + 1) + x];
+    else
+      d = sum_gaussian(map, opacity, x - center, center, width, height);
+    for (y = gsize; y < sheight - gsize; y++) {
+      data[y * swidth + x] = d;
+      data[y * swidth + (swidth - x - 1)] = d;
+    }
+  }
+
+  return data;
+}
+
+int diagonal_segment_count(double direction, double spacing, int width,
+                           int height) {
+  if (spacing <= 0)
+    return 0;
+  double theta = direction * M_PI / 180.0;
+  double dist = sin(theta) * width + fabs(cos(theta)) * height;
+  return dist / spacing + 1;
+}
+
+void diagonal_segments(double direction, double spacing, int width, int height,
+                       XSegment *lines) {
+  int line_count = diagonal_segment_count(direction, spacing, width, height);
+  double theta = direction * M_PI / 180.0;
+  for (int i = 0; i < line_count; ++i) {
+    double x1, y1, x2, y2;
+
+    double left_y;
+    if (theta < M_PI / 2) {
+      left_y = i * spacing / cos(theta);
+    } else {
+      left_y = height + i * spacing / cos(theta);
+    }
+    if (left_y > height) {
+      x1 = (left_y - height) / tan(theta);
+      y1 = height;
+    } else if (left_y < 0) {
+      x1 = left_y / tan(theta);
+      y1 = 0;
+    } else {
+      x1 = 0;
+      y1 = left_y;
+    }
+    double right_y = left_y - width * tan(theta);
+    if (right_y < 0) {
+      x2 = width + right_y / tan(theta);
+      y2 = 0;
+    } else if (right_y > height) {
+      x2 = width + (right_y - height) / tan(theta);
+      y2 = height;
+    } else {
+      x2 = width;
+      y2 = right_y;
+    }
+
+    lines[i].x1 = x1;
+    lines[i].y1 = y1;
+    lines[i].x2 = x2;
+    lines[i].y2 = y2;
+  }
+}
@@ -0,0 +1,44 @@
+#ifndef DIAGONATOR_KERNELS_H
+#define DIAGONATOR_KERNELS_H
+
+#include <X11/Xlib.h>
+
+typedef struct _conv {
+  int size;
+  double *data;
+} conv;
+
+conv *make_gaussian_map(double r);
+
+unsigned char sum_gaussian(conv *map, double opacity, int x, int y, int width,
+                           int height);
+
+/* The shadow corners and sides of a gaussian map, at 26 opacities */
+typedef struct _shadow_tables {
+  conv *map; /* not owned */
+  unsigned char *corner;
+  unsigned char *top;
+} shadow_tables;
+
+/* Precompute the shadow corners and sides for map, or NULL when out of
+ * memory. The tables refer to map, which must outlive them. */
+shadow_tables *presum_gaussian(conv *map);
+
+void free_shadow_tables(shadow_tables *t);
+
+/* Compute the alpha values of a shadow for a width by height window into a
+ * new *swp by *shp buffer. This only reads t, so it can run on several
+ * threads at once.
+ */
+unsigned char *make_shadow_data(const shadow_tables *t, double opacity,
+                                int width, int height, int *swp, int *shp);
+
+/* Number of lines diagonal_segments computes for these parameters */
+int diagonal_segment_count(double direction, double spacing, int width,
+                           int height);
+
+/* The lines of one layer across a width x height area, clipped to it */
+void diagonal_segments(double direction, double spacing, int width, int height,
+                       XSegment *lines);
+
+#endif
@@ -16,6 +16,30 @@ static double DIAGONATOR_LINE_SPACING = 50.0;
 // Style of the lines (0 = LineSolid, 1 = LineOnOffDash, 2 = LineDoubleDash)
 static int DIAGONATOR_LINE_STYLE = 0;
 
+// Colour of the lines, as #AARRGGBB or #RRGGBB
+static const char *DIAGONATOR_LINE_COLOR = "#ff000000";
+
+// Dash lengths for the dashed line styles, in pixels, separated by colons (for
+// example "10:5"). An empty string uses the X default dash list.
+static const char *DIAGONATOR_LINE_DASHES = "";
+
+// Time the lines take to fade in or out when the _DIAGONATOR_OPACITY property
+// on the root window changes, in milliseconds
+static int DIAGONATOR_FADE_TIME = 2000;
+
+// Spacings of the first layer for each density level, separated by commas
+// (for example "50,35,20"). The _DIAGONATOR_LEVEL property on the root window
+// chooses a level by its index, and the other layers are scaled along with the
+// first one. An empty string uses a single level with DIAGONATOR_LINE_SPACING.
+static const char *DIAGONATOR_LINE_SPACING_LEVELS = "";
+
+// Speed at which the lines scroll across the screen, in pixels per second
+// (0 = no scrolling). Only patterns made of solid lines scroll.
+static double DIAGONATOR_SCROLL_SPEED = 0;
+
+// Frame rate of the scrolling, in frames per second
+static int DIAGONATOR_SCROLL_FPS = 30;
+
 /* Configure the margins to make diagonator draw in a custom rectangular area
  * instead of your entire screen. For example, you could configure
  * DIAGONATOR_TOP_MARGIN if you don't want diagonator to draw over your status
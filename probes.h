@@ -0,0 +1,34 @@
+#ifndef DIAGONATOR_PROBES_H
+#define DIAGONATOR_PROBES_H
+
+/* USDT probes for bpftrace, perf and SystemTap, in the diagonator provider.
+ * They are built in when the Makefile finds <sys/sdt.h> and sets HAVE_SDT,
+ * and are a single nop each until a tracer attaches. Every probe needs a
+ * PROBE_SEMAPHORE, which the tracer raises while it is attached, so that
+ * arguments that cost something to work out can be skipped unless
+ * PROBE_ENABLED().
+ */
+
+#if HAVE_SDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define PROBE_SEMAPHORE(name)                                                  \
+  unsigned short diagonator_##name##_semaphore                                 \
+      __attribute__((unused, section(".probes")))
+#define PROBE_ENABLED(name) __builtin_expect(diagonator_##name##_semaphore, 0)
+
+#define PROBE1(name, a) DTRACE_PROBE1(diagonator, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(diagonator, name, a, b)
+#define PROBE5(name, a, b, c, d, e)                                            \
+  DTRACE_PROBE5(diagonator, name, a, b, c, d, e)
+#else
+#define PROBE_SEMAPHORE(name) extern int diagonator_no_probes
+#define PROBE_ENABLED(name) 0
+#define PROBE1(name, a) ((void)(a))
+#define PROBE2(name, a, b) ((void)(a), (void)(b))
+#define PROBE5(name, a, b, c, d, e)                                            \
+  ((void)(a), (void)(b), (void)(c), (void)(d), (void)(e))
+#endif
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef DIAGONATOR_RECORD_H
+#define DIAGONATOR_RECORD_H
+
+/* The file written by --record and read by bench/replay: a record_header
+ * followed by one record for each event that the main loop handled.
+ */
+
+#include <stdint.h>
+
+#define RECORD_MAGIC 0x43455244 /* "DREC" */
+#define RECORD_VERSION 1
+
+typedef struct _record_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t record_size;
+  uint16_t root_width;
+  uint16_t root_height;
+} record_header;
+
+/* Record types are X event types, plus these for extension events */
+#define RecordDamage 128
+#define RecordShape 129
+
+typedef struct _record {
+  uint32_t time; /* milliseconds since the recording started */
+  uint8_t type;
+  /* override_redirect for create and configure, the place of a circulate,
+   * whether a shape event left the window shaped */
+  uint8_t flag;
+  uint16_t border_width;
+  uint32_t window;
+  uint32_t sibling; /* the window above for configure, parent for reparent */
+  int16_t x, y;
+  uint16_t width, height;
+  uint32_t value; /* the new opacity for a property change */
+} record;
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef DIAGONATOR_STATS_H
+#define DIAGONATOR_STATS_H
+
+/* The page diagonator --stats-page keeps up to date in a file, normally in
+ * /dev/shm, for monitoring tools to mmap and read while it runs.
+ *
+ * The counters are written under a sequence lock: sequence is odd while
+ * they are being changed, so a reader copies them with stats_page_read,
+ * which retries until it gets a copy from between two updates. Fields are
+ * only ever added at the end of stats_counters; anything else bumps
+ * DIAGONATOR_STATS_VERSION.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define DIAGONATOR_STATS_MAGIC 0x54534744 /* "DGST" */
+#define DIAGONATOR_STATS_VERSION 1
+
+#define STATS_EVENT_TYPES 128
+/* bucket 0 counts frames painted in under 32us, bucket i > 0 those that
+ * took from 2^(i+4) up to 2^(i+5) microseconds, and the last bucket all
+ * longer ones */
+#define STATS_PAINT_BUCKETS 20
+
+typedef struct _stats_counters {
+  uint64_t frames;
+  uint64_t damage_events;
+  uint64_t damage_rects;
+  uint64_t damage_area; /* in pixels */
+  uint64_t round_trips;
+  uint64_t events[STATS_EVENT_TYPES]; /* by X event type */
+  uint64_t paint_us[STATS_PAINT_BUCKETS];
+  uint32_t windows;
+  uint32_t mapped_windows;
+  uint32_t fades;
+  /* server resources created and not yet freed */
+  int32_t live_pictures;
+  int32_t live_pixmaps;
+  int32_t live_regions;
+  int32_t live_damages;
+  uint32_t reserved; /* for the alignment of cpu_seconds */
+  double cpu_seconds;
+  uint64_t updated_ms; /* CLOCK_MONOTONIC time of the last update */
+} stats_counters;
+
+typedef struct _stats_page {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size; /* of the whole page */
+  uint32_t sequence;
+  stats_counters counters;
+} stats_page;
+
+static inline void stats_page_read(const stats_page *page, stats_counters *c) {
+  uint32_t before, after;
+
+  do {
+    before = __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+    memcpy(c, (const void *)&page->counters, sizeof(*c));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&page->sequence, __ATOMIC_RELAXED);
+  } while ((before & 1) || before != after);
+}
+
+#endif
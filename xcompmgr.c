@@ -28,23 +28,38 @@
 #include "config.h"
 #endif
 
+#include "kernels.h"
 #include "options.h"
+#include "probes.h"
+#include "record.h"
+#include "stats.h"
 #include <X11/Xatom.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/Xlib.h>
+#include <X11/Xlibint.h>
 #include <X11/Xutil.h>
 #include <X11/extensions/Xcomposite.h>
+#include <X11/extensions/XRes.h>
 #include <X11/extensions/Xdamage.h>
 #include <X11/extensions/Xrender.h>
 #include <X11/extensions/shape.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/poll.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
+#include <xcb/xcb.h>
 
 #if COMPOSITE_MAJOR > 0 || COMPOSITE_MINOR >= 2
 #define HAS_NAME_WINDOW_PIXMAP 1
@@ -52,9 +67,10 @@
 
 #define CAN_DO_USABLE 0
 
+/* a range of request sequence numbers whose errors are expected */
 typedef struct _ignore {
-  struct _ignore *next;
-  unsigned long sequence;
+  unsigned long first;
+  unsigned long last;
 } ignore;
 
 typedef struct _win {
@@ -77,6 +93,11 @@ typedef struct _win {
   XserverRegion borderSize;
   XserverRegion extents;
   Picture shadow;
+  /* what the shadow was made for, to reuse it from shadowCache */
+  int shadow_for_width;
+  int shadow_for_height;
+  double shadow_for_opacity;
+  Bool shadow_pending; /* being made by a shadow worker */
   int shadow_dx;
   int shadow_dy;
   int shadow_width;
@@ -84,18 +105,33 @@ typedef struct _win {
   unsigned int opacity;
   Atom windowType;
   unsigned long damage_sequence; /* sequence when damage was created */
-  Bool shaped;
-  XRectangle shape_bounds;
 
   /* for drawing translucent windows */
   XserverRegion borderClip;
   struct _win *prev_trans;
-} win;
 
-typedef struct _conv {
-  int size;
-  double *data;
-} conv;
+  /* for keeping the lines off this window */
+  Bool excluded;
+  Bool in_exclude; /* exclude_rect is taken out of the lines */
+  XRectangle exclude_rect;
+  Bool above_overlay; /* painted on top of the lines this frame */
+
+  /* ConfigureNotify work put off until the next frame */
+  Bool configure_pending;
+  Bool size_changed; /* since the last frame, even if changed back */
+  XserverRegion configure_damage;
+
+  /* damage received since the last frame */
+  Bool damage_pending;
+  XRectangle *damage_rects; /* relative to the window, for delta rectangles */
+  int n_damage_rects;
+  int size_damage_rects;
+
+  /* for --latency, when the first damage since the last frame arrived and
+   * the time the client stamped its drawing with, 0 when there is none */
+  double damage_time;
+  double draw_time;
+} win;
 
 typedef struct _fade {
   struct _fade *next;
@@ -108,23 +144,217 @@ typedef struct _fade {
   Bool gone;
 } fade;
 
+#define MAX_DASHES 16
+
+/* bounds on the size of a repeating tile of the line pattern */
+#define MIN_TILE_SIZE 64
+#define MAX_TILE_SIZE 1024
+
+typedef struct _line_layer {
+  double direction;
+  int width;
+  double spacing;
+  int style;
+  /* premultiplied colour */
+  double alpha, red, green, blue;
+  char dashes[MAX_DASHES];
+  int n_dashes;
+} line_layer;
+
+typedef struct _overlay_level {
+  double spacing; /* spacing of the first layer */
+  Picture picture;
+  int tile_width; /* 0 unless the picture is a repeating tile */
+  int tile_height;
+} overlay_level;
+
+/* a shadow kept after its window was unmapped or destroyed */
+typedef struct _cached_shadow {
+  struct _cached_shadow *next;
+  int for_width;
+  int for_height;
+  double for_opacity;
+  Picture shadow;
+  int width;
+  int height;
+} cached_shadow;
+
+/* a shadow made off the main thread by a shadow worker */
+typedef struct _shadow_job {
+  struct _shadow_job *next;
+  Window id;
+  double opacity;
+  int width;
+  int height;
+  unsigned char *data; /* the result, swidth by sheight alpha values */
+  int swidth;
+  int sheight;
+} shadow_job;
+
+typedef struct _stats {
+  unsigned long frames;
+  double paint_cpu; /* seconds */
+  unsigned long paint_requests;
+  unsigned long scroll_frames;
+  double scroll_cpu;
+  unsigned long scroll_requests;
+  unsigned long shadow_cache_hits;
+  unsigned long shadow_cache_misses;
+  unsigned long configure_events;
+  unsigned long configures_flushed;
+  unsigned long damage_events;
+  unsigned long damage_requests;
+  unsigned long damage_rects_in;
+  unsigned long damage_rects_out;
+  long damage_overdraw; /* can be negative when rectangles overlapped */
+  unsigned long ignore_allocs;
+  unsigned long round_trips;
+  unsigned long shadow_jobs;
+  unsigned long region_creates;
+  unsigned long region_destroys;
+  unsigned long region_reuses;
+  unsigned long request_bytes;
+} stats;
+
 static win *list;
 static fade *fades;
 static int scr;
 static Window root;
 static Picture rootPicture;
 static Picture rootBuffer;
-static Picture overlayPicture;
+static overlay_level *overlayLevels;
+static int n_overlay_levels;
+static int overlayLevel;
+static line_layer *layers;
+static int n_layers;
+static double overlayOpacity = 1.0;
+static double overlayTarget = 1.0;
+static double overlayStep;
+static int scroll_start;
+static int scroll_time;
+static int scrollX, scrollY;
+static Bool scrollFrame; /* the next frame was caused by scrolling */
+static stats frameStats;
+static int statsInterval; /* milliseconds, 0 when not reporting */
+/* wall-clock paint time of each frame in microseconds, for percentiles */
+#define PAINT_SAMPLES 8192
+static float paintTimes[PAINT_SAMPLES];
+static int n_paint_times;
+/* --latency: microseconds from a client's drawing, and from its damage
+ * reaching diagonator, until the server has finished the frame showing it */
+static Bool latencyProbe;
+static float drawLatencies[PAINT_SAMPLES];
+static float damageLatencies[PAINT_SAMPLES];
+static int n_draw_latencies, n_damage_latencies;
+
+/* requests sent through Xlib by major and, for extensions, minor opcode */
+#define MAX_MINOR_OPCODE 64
+static unsigned long opcodeCounts[256][MAX_MINOR_OPCODE];
+static const char *extensionNames[256];
+/* bytes of a request that continue in the next flush */
+static unsigned long requestSkip;
+
+/* the counters --stats-page publishes, see stats.h */
+static stats_counters pageStats;
+static stats_page *statsPage;
+/* the part of frameStats.round_trips already added to pageStats */
+static unsigned long pageRoundTrips;
+
+/* --resources: what the server holds for diagonator, by what it is for */
+typedef enum _resource_kind {
+  ResOther,
+  ResWindowPicture,
+  ResWindowPixmap,
+  ResShadow,
+  ResSolid,
+  ResRoot,
+  ResOverlay,
+  ResBackground,
+  ResRegion,
+  ResDamage,
+  NumResourceKinds
+} ResourceKind;
+
+static const char *resourceKindNames[] = {
+    "other",   "window_pictures", "window_pixmaps", "shadows",
+    "solid",   "root",            "overlay",        "background",
+    "regions", "damages"};
+
+typedef enum _resource_type {
+  ResTypePixmap,
+  ResTypePicture,
+  ResTypeRegion,
+  ResTypeDamage,
+  NumResourceTypes
+} ResourceType;
+
+/* the names X-Resource gives these types */
+static const char *resourceTypeNames[] = {"PIXMAP", "PICTURE", "XFixesRegion",
+                                          "DamageExt"};
+
+typedef struct _resource {
+  struct _resource *next;
+  XID id;
+  XID drawable; /* what a picture was made from */
+  XID picture;  /* the last picture made from a pixmap */
+  ResourceKind kind;
+  ResourceType type;
+  /* estimated server memory; a pixmap's goes to the picture made from it
+   * when the pixmap is freed first */
+  unsigned long bytes;
+} resource;
+
+#define RESOURCE_BUCKETS 1024
+static resource *resources[RESOURCE_BUCKETS];
+static int resourceInterval; /* milliseconds, 0 when not accounting */
+static int resources_time;
+static Bool hasXRes;
+static Atom resourceTypeAtoms[NumResourceTypes];
+
+/* where --record writes the events, see record.h */
+static FILE *recordFile;
+static int record_start;
+static int stats_time;
+static int stats_start; /* when the counters were last reset */
 static Picture blackPicture;
 static Picture transBlackPicture;
 static Picture rootTile;
+static Picture backgroundPicture;
+static int backgroundLevel;
+static int backgroundAlpha;
+static Bool cacheBackground;
 static XserverRegion allDamage;
+/* regions that are no longer used, to be refilled instead of created */
+#define REGION_POOL_SIZE 64
+static XserverRegion regionPool[REGION_POOL_SIZE];
+static int n_region_pool;
 static Bool clipChanged;
+static Bool configurePending;
+static Bool damagePending;
+static int damageLevel = XDamageReportNonEmpty;
+static XRectangle *damageRects;
+static int n_damage_rects, size_damage_rects;
+
+/* damage simplification, off while damageMaxRects is 0 */
+static int damageMaxRects;
+static int damageMergeDistance = 8;
+static double damageMaxWaste = 0.5;
+
+#define DAMAGE_TILE_SIZE 256
 #if HAS_NAME_WINDOW_PIXMAP
 static Bool hasNamePixmap;
 #endif
 static int root_height, root_width;
-static ignore *ignore_head, **ignore_tail = &ignore_head;
+/* the connection under dpy, for requests whose replies can be pipelined */
+static xcb_connection_t *xcb;
+/* sent after each frame and waited for before the next one */
+static xcb_get_input_focus_cookie_t frameFence;
+static Bool fencePending;
+/* ring buffer of ignored ranges, oldest first */
+static ignore *ignores;
+static int ignore_start, ignore_count, ignore_size;
+/* the newest range is still open, see begin_ignore */
+static Bool ignoreBatch;
 static int xfixes_event, xfixes_error;
 static int damage_event, damage_error;
 static int composite_event, composite_error;
@@ -132,6 +362,7 @@ static int render_event, render_error;
 static int xshape_event, xshape_error;
 static Bool synchronize;
 static int composite_opcode;
+static int render_opcode, xfixes_opcode, damage_opcode;
 
 /* find these once and be done with it */
 static Atom opacityAtom;
@@ -144,14 +375,47 @@ static Atom winUtilAtom;
 static Atom winSplashAtom;
 static Atom winDialogAtom;
 static Atom winNormalAtom;
+static Atom overlayOpacityAtom;
+static Atom overlayLevelAtom;
+static Atom latencyAtom;
+
+/* windows the lines are kept off */
+static char **excludeClasses;
+static int n_exclude_classes;
+static Atom *excludeTypes;
+static int n_exclude_types;
+static XserverRegion overlayExclude;
+static int n_overlay_exclude;
+static Bool exclusionChanged; /* overlayExclude must be rebuilt */
+
+/* window types that are stacked above the lines */
+static Atom *linesBelowTypes;
+static int n_lines_below_types;
 
 /* opacity property name; sometime soon I'll write up an EWMH spec for it */
 #define OPACITY_PROP "_NET_WM_WINDOW_OPACITY"
 
+/* same format, set on the root window to fade the lines in and out */
+#define OVERLAY_OPACITY_PROP "_DIAGONATOR_OPACITY"
+
+/* cardinal on the root window choosing one of the --line-spacing-levels */
+#define OVERLAY_LEVEL_PROP "_DIAGONATOR_LEVEL"
+
+/* two cardinals, the high and low halves of the CLOCK_MONOTONIC time in
+ * microseconds, that a client sets on its window before drawing for
+ * --latency, see bench/latency.c */
+#define LATENCY_PROP "_DIAGONATOR_LATENCY_STAMP"
+
 #define TRANSLUCENT 0xe0000000
 #define OPAQUE 0xffffffff
 
 static conv *gaussianMap;
+static shadow_tables *shadowTables;
+
+/* number of distinct mask pictures the lines are faded through */
+#define OVERLAY_ALPHA_LEVELS 64
+
+static Picture overlayAlpha[OVERLAY_ALPHA_LEVELS];
 
 #define WINDOW_SOLID 0
 #define WINDOW_TRANS 1
@@ -179,6 +443,17 @@ static double get_opacity_percent(Display *dpy, win *w, double def);
 
 static XserverRegion win_extents(Display *dpy, win *w);
 
+static void free_region(Display *dpy, XserverRegion region);
+static void rebuild_exclusion(Display *dpy);
+
+static void build_overlay_levels(Display *dpy);
+
+static void free_overlay_levels(Display *dpy);
+
+static void step_overlay_fade(Display *dpy, int steps);
+
+static void damage_overlay(Display *dpy);
+
 static CompMode compMode = CompSimple;
 
 static int shadowRadius = 12;
@@ -196,10 +471,73 @@ static Bool fadeTrans = False;
 
 static Bool autoRedirect = False;
 
-/* For shadow precomputation */
-static int Gsize = -1;
-static unsigned char *shadowCorner = NULL;
-static unsigned char *shadowTop = NULL;
+/* most recently used first */
+static cached_shadow *shadowCache;
+static unsigned long shadowCacheBytes;
+static unsigned long shadowCacheLimit = 16 << 20;
+
+static int shadowThreads = 0;
+static pthread_mutex_t shadowLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shadowCond = PTHREAD_COND_INITIALIZER;
+static shadow_job *shadowJobs, *shadowResults;
+/* written to by the workers whenever a result is ready */
+static int shadowPipe[2] = {-1, -1};
+
+/* What the flight recorder keeps track of, see trace() */
+typedef enum _trace_name {
+  TraceEvent,
+  TracePaint,
+  TracePaintOpaque,
+  TracePaintRoot,
+  TracePaintTranslucent,
+  TracePaintOverlay,
+  TracePaintCopy,
+  TraceFlushConfigures,
+  TraceFlushDamage,
+  TraceShadow,
+  TraceFades,
+  TraceRoundTrip,
+  TraceAddWin,
+} TraceName;
+
+static const char *traceNames[] = {"event",
+                                   "paint_all",
+                                   "opaque pass",
+                                   "root",
+                                   "translucent pass",
+                                   "overlay",
+                                   "copy",
+                                   "flush_configures",
+                                   "flush_damage",
+                                   "shadow",
+                                   "fades",
+                                   "round trip",
+                                   "add_win"};
+
+typedef struct _trace_span {
+  uint64_t start;    /* nanoseconds, CLOCK_MONOTONIC */
+  uint64_t duration; /* nanoseconds */
+  uint16_t name;     /* TraceName */
+  uint16_t thread;   /* 0 for the main thread, shadow workers from 1 */
+  long arg;          /* the event type, shadow size or number of fades */
+} trace_span;
+
+/* the last traceSize spans, overwritten in a circle; empty when 0 */
+static trace_span *traces;
+static int traceSize = 32768;
+static unsigned long traceNext;
+static const char *tracePath;
+static __thread int traceThread;
+static volatile sig_atomic_t traceDumpRequested;
+
+/* one for each of the USDT probes, see probes.h */
+PROBE_SEMAPHORE(paint_all_entry);
+PROBE_SEMAPHORE(paint_all_return);
+PROBE_SEMAPHORE(damage_win);
+PROBE_SEMAPHORE(configure_win);
+PROBE_SEMAPHORE(add_win);
+PROBE_SEMAPHORE(finish_destroy_win);
+PROBE_SEMAPHORE(shadow_picture);
 
 static int get_time_in_milliseconds(void) {
   struct timeval tv;
@@ -208,6 +546,132 @@ static int get_time_in_milliseconds(void) {
   return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+static uint64_t trace_clock(void) {
+  struct timespec ts;
+
+  if (!traces)
+    return 0;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Keep a span from start, taken with trace_clock(), until now in the flight
+ * recorder and return the time it ended, to start the next one
+ */
+static uint64_t trace(TraceName name, uint64_t start, long arg) {
+  uint64_t now = trace_clock();
+  trace_span *t;
+
+  if (!traces)
+    return 0;
+  t = &traces[__atomic_fetch_add(&traceNext, 1, __ATOMIC_RELAXED) %
+              traceSize];
+  t->start = start;
+  t->duration = now - start;
+  t->name = name;
+  t->thread = traceThread;
+  t->arg = arg;
+  return now;
+}
+
+static const char *trace_event_name(int type) {
+  static const char *names[] = {
+      [CreateNotify] = "CreateNotify",
+      [ConfigureNotify] = "ConfigureNotify",
+      [DestroyNotify] = "DestroyNotify",
+      [MapNotify] = "MapNotify",
+      [UnmapNotify] = "UnmapNotify",
+      [ReparentNotify] = "ReparentNotify",
+      [CirculateNotify] = "CirculateNotify",
+      [Expose] = "Expose",
+      [PropertyNotify] = "PropertyNotify",
+  };
+
+  if (type == damage_event + XDamageNotify)
+    return "DamageNotify";
+  if (type == xshape_event + ShapeNotify)
+    return "ShapeNotify";
+  if (type < (int)(sizeof(names) / sizeof(names[0])))
+    return names[type];
+  return NULL;
+}
+
+/* Write the flight recorder to tracePath in the Chrome trace event format,
+ * which chrome://tracing and Perfetto open
+ */
+static void dump_trace(void) {
+  unsigned long n = traceNext, i;
+  FILE *file;
+  int thread;
+
+  traceDumpRequested = 0;
+  if (!traces)
+    return;
+  file = fopen(tracePath, "w");
+  if (!file) {
+    perror(tracePath);
+    return;
+  }
+  fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  for (i = n > (unsigned long)traceSize ? n - traceSize : 0; i < n; i++) {
+    trace_span *t = &traces[i % traceSize];
+    const char *name = traceNames[t->name];
+    char buf[32];
+
+    if (t->name == TraceEvent) {
+      name = trace_event_name(t->arg);
+      if (!name) {
+        snprintf(buf, sizeof(buf), "event %ld", t->arg);
+        name = buf;
+      }
+    }
+    fprintf(file,
+            "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+            "\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":%ld}},\n",
+            name, t->start / 1e3, t->duration / 1e3, (int)getpid(), t->thread,
+            t->arg);
+  }
+  for (thread = 0; thread <= shadowThreads; thread++)
+    fprintf(file,
+            "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}%s\n",
+            (int)getpid(), thread, thread ? "shadow worker" : "main", thread,
+            thread < shadowThreads ? "," : "");
+  fprintf(file, "]}\n");
+  fclose(file);
+  fprintf(stderr, "trace written to %s\n", tracePath);
+}
+
+/* Count a request whose reply the compositor waits for, and return the time
+ * to trace the wait from
+ */
+static uint64_t round_trip(void) {
+  frameStats.round_trips++;
+  return trace_clock();
+}
+
+static void request_trace_dump(int sig) { traceDumpRequested = 1; }
+
+static void start_trace(void) {
+  static char path[64];
+  struct sigaction sa;
+
+  if (traceSize <= 0)
+    return;
+  traces = calloc(traceSize, sizeof(trace_span));
+  if (!traces)
+    return;
+  if (!tracePath) {
+    snprintf(path, sizeof(path), "/tmp/diagonator-trace-%d.json",
+             (int)getpid());
+    tracePath = path;
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = request_trace_dump;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR2, &sa, NULL);
+}
+
 static fade *find_fade(win *w) {
   fade *f;
 
@@ -238,7 +702,7 @@ static void cleanup_fade(Display *dpy, win *w) {
 }
 
 static void enqueue_fade(Display *dpy, fade *f) {
-  if (!fades)
+  if (!fades && overlayOpacity == overlayTarget)
     fade_time = get_time_in_milliseconds() + fade_delta;
   f->next = fades;
   fades = f;
@@ -284,6 +748,8 @@ static void set_fade(Display *dpy, win *w, double start, double finish,
   if (w->shadow) {
     XRenderFreePicture(dpy, w->shadow);
     w->shadow = None;
+    if (w->extents)
+      free_region(dpy, w->extents);
     w->extents = win_extents(dpy, w);
   }
 }
@@ -291,7 +757,7 @@ static void set_fade(Display *dpy, win *w, double start, double finish,
 static int fade_timeout(void) {
   int now;
   int delta;
-  if (!fades)
+  if (!fades && overlayOpacity == overlayTarget)
     return -1;
   now = get_time_in_milliseconds();
   delta = fade_time - now;
@@ -304,20 +770,26 @@ static int fade_timeout(void) {
 static void run_fades(Display *dpy) {
   int now = get_time_in_milliseconds();
   fade *next = fades;
-  int steps;
+  int steps, n = 0;
   Bool need_dequeue;
+  uint64_t traced;
 
 #if 0
     printf ("run fades\n");
 #endif
   if (fade_time - now > 0)
     return;
+  traced = trace_clock();
   steps = 1 + (now - fade_time) / fade_delta;
 
+  if (overlayOpacity != overlayTarget)
+    step_overlay_fade(dpy, steps);
+
   while (next) {
     fade *f = next;
     win *w = f->w;
     next = f->next;
+    n++;
     f->cur += f->step * steps;
     if (f->cur >= 1)
       f->cur = 1;
@@ -343,6 +815,8 @@ static void run_fades(Display *dpy) {
     if (w->shadow) {
       XRenderFreePicture(dpy, w->shadow);
       w->shadow = None;
+      if (w->extents)
+        free_region(dpy, w->extents);
       w->extents = win_extents(dpy, w);
     }
     /* Must do this last as it might destroy f->w in callbacks */
@@ -350,256 +824,587 @@ static void run_fades(Display *dpy) {
       dequeue_fade(dpy, f);
   }
   fade_time = now + fade_delta;
+  trace(TraceFades, traced, n);
 }
 
-static double gaussian(double r, double x, double y) {
-  return ((1 / (sqrt(2 * M_PI * r))) * exp((-(x * x + y * y)) / (2 * r * r)));
+static int scroll_timeout(void) {
+  int delta;
+  if (DIAGONATOR_SCROLL_SPEED == 0)
+    return -1;
+  delta = scroll_time - get_time_in_milliseconds();
+  if (delta < 0)
+    delta = 0;
+  return delta;
 }
 
-static conv *make_gaussian_map(Display *dpy, double r) {
-  conv *c;
-  int size = ((int)ceil((r * 3)) + 1) & ~1;
-  int center = size / 2;
+/* Scrolling only changes the source origin the repeating tile is composited
+ * from, so a frame costs the same single composite as a static one.
+ */
+static void run_scroll(Display *dpy) {
+  int now = get_time_in_milliseconds();
+  double theta = layers[0].direction * M_PI / 180.0;
+  double dist;
   int x, y;
-  double t;
-  double g;
-
-  c = malloc(sizeof(conv) + size * size * sizeof(double));
-  c->size = size;
-  c->data = (double *)(c + 1);
-  t = 0.0;
-  for (y = 0; y < size; y++)
-    for (x = 0; x < size; x++) {
-      g = gaussian(r, (double)(x - center), (double)(y - center));
-      t += g;
-      c->data[y * size + x] = g;
-    }
-  /*    printf ("gaussian total %f\n", t); */
-  for (y = 0; y < size; y++)
-    for (x = 0; x < size; x++) {
-      c->data[y * size + x] /= t;
-    }
-  return c;
+
+  if (DIAGONATOR_SCROLL_SPEED == 0 || scroll_time - now > 0)
+    return;
+  /* move across the lines of the first layer */
+  dist = (now - scroll_start) / 1000.0 * DIAGONATOR_SCROLL_SPEED;
+  x = (int)floor(dist * sin(theta));
+  y = (int)floor(dist * cos(theta));
+  if ((x != scrollX || y != scrollY) && overlayOpacity > 0 &&
+      overlayLevels[overlayLevel].tile_width) {
+    damage_overlay(dpy);
+    scrollFrame = True;
+  }
+  scrollX = x;
+  scrollY = y;
+  scroll_time = now + 1000 / DIAGONATOR_SCROLL_FPS;
 }
 
-/*
- * A picture will help
- *
- *	-center   0                width  width+center
- *  -center +-----+-------------------+-----+
- *	    |     |                   |     |
- *	    |     |                   |     |
- *        0 +-----+-------------------+-----+
- *	    |     |                   |     |
- *	    |     |                   |     |
- *	    |     |                   |     |
- *   height +-----+-------------------+-----+
- *	    |     |                   |     |
- * height+  |     |                   |     |
- *  center  +-----+-------------------+-----+
- */
+static double cpu_time(void) {
+  struct timespec ts;
 
-static unsigned char sum_gaussian(conv *map, double opacity, int x, int y,
-                                  int width, int height) {
-  int fx, fy;
-  double *g_data;
-  double *g_line = map->data;
-  int g_size = map->size;
-  int center = g_size / 2;
-  int fx_start, fx_end;
-  int fy_start, fy_end;
-  double v;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-  /*
-   * Compute set of filter values which are "in range",
-   * that's the set with:
-   *	0 <= x + (fx-center) && x + (fx-center) < width &&
-   *  0 <= y + (fy-center) && y + (fy-center) < height
-   *
-   *  0 <= x + (fx - center)	x + fx - center < width
-   *  center - x <= fx	fx < width + center - x
-   */
+static double wall_time(void) {
+  struct timespec ts;
 
-  fx_start = center - x;
-  if (fx_start < 0)
-    fx_start = 0;
-  fx_end = width + center - x;
-  if (fx_end > g_size)
-    fx_end = g_size;
-
-  fy_start = center - y;
-  if (fy_start < 0)
-    fy_start = 0;
-  fy_end = height + center - y;
-  if (fy_end > g_size)
-    fy_end = g_size;
-
-  g_line = g_line + fy_start * g_size + fx_start;
-
-  v = 0;
-  for (fy = fy_start; fy < fy_end; fy++) {
-    g_data = g_line;
-    g_line += g_size;
-
-    for (fx = fx_start; fx < fx_end; fx++)
-      v += *g_data++;
-  }
-  if (v > 1)
-    v = 1;
-
-  return ((unsigned char)(v * opacity * 255.0));
-}
-
-/* precompute shadow corners and sides to save time for large windows */
-static void presum_gaussian(conv *map) {
-  int center = map->size / 2;
-  int opacity, x, y;
-
-  Gsize = map->size;
-
-  if (shadowCorner)
-    free((void *)shadowCorner);
-  if (shadowTop)
-    free((void *)shadowTop);
-
-  shadowCorner = (unsigned char *)(malloc((Gsize + 1) * (Gsize + 1) * 26));
-  shadowTop = (unsigned char *)(malloc((Gsize + 1) * 26));
-
-  for (x = 0; x <= Gsize; x++) {
-    shadowTop[25 * (Gsize + 1) + x] =
-        sum_gaussian(map, 1, x - center, center, Gsize * 2, Gsize * 2);
-    for (opacity = 0; opacity < 25; opacity++)
-      shadowTop[opacity * (Gsize + 1) + x] =
-          shadowTop[25 * (Gsize + 1) + x] * opacity / 25;
-    for (y = 0; y <= x; y++) {
-      shadowCorner[25 * (Gsize + 1) * (Gsize + 1) + y * (Gsize + 1) + x] =
-          sum_gaussian(map, 1, x - center, y - center, Gsize * 2, Gsize * 2);
-      shadowCorner[25 * (Gsize + 1) * (Gsize + 1) + x * (Gsize + 1) + y] =
-          shadowCorner[25 * (Gsize + 1) * (Gsize + 1) + y * (Gsize + 1) + x];
-      for (opacity = 0; opacity < 25; opacity++)
-        shadowCorner[opacity * (Gsize + 1) * (Gsize + 1) + y * (Gsize + 1) +
-                     x] = shadowCorner[opacity * (Gsize + 1) * (Gsize + 1) +
-                                       x * (Gsize + 1) + y] =
-            shadowCorner[25 * (Gsize + 1) * (Gsize + 1) + y * (Gsize + 1) + x] *
-            opacity / 25;
-    }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int stats_timeout(void) {
+  int delta;
+  if (!statsInterval)
+    return -1;
+  delta = stats_time - get_time_in_milliseconds();
+  if (delta < 0)
+    delta = 0;
+  return delta;
+}
+
+static double per_frame(double total, unsigned long frames) {
+  return frames ? total / frames : 0;
+}
+
+static void count_frame(double cpu, double wall, unsigned long requests) {
+  if (n_paint_times < PAINT_SAMPLES)
+    paintTimes[n_paint_times++] = wall * 1e6;
+  frameStats.frames++;
+  frameStats.paint_cpu += cpu;
+  frameStats.paint_requests += requests;
+  if (scrollFrame) {
+    frameStats.scroll_frames++;
+    frameStats.scroll_cpu += cpu;
+    frameStats.scroll_requests += requests;
   }
 }
 
-static XImage *make_shadow(Display *dpy, double opacity, int width,
-                           int height) {
-  XImage *ximage;
-  unsigned char *data;
-  int gsize = gaussianMap->size;
-  int ylimit, xlimit;
-  int swidth = width + gsize;
-  int sheight = height + gsize;
-  int center = gsize / 2;
-  int x, y;
-  unsigned char d;
-  int x_diff;
-  int opacity_int = (int)(opacity * 25);
-  data = malloc(swidth * sheight * sizeof(unsigned char));
-  if (!data)
-    return NULL;
-  ximage = XCreateImage(dpy, DefaultVisual(dpy, DefaultScreen(dpy)), 8, ZPixmap,
-                        0, (char *)data, swidth, sheight, 8,
-                        swidth * sizeof(unsigned char));
-  if (!ximage) {
-    free(data);
-    return NULL;
+static int compare_times(const void *a, const void *b) {
+  float x = *(const float *)a, y = *(const float *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* the time below which a fraction p of the n sorted times are */
+static double percentile(const float *times, int n, double p) {
+  if (!n)
+    return 0;
+  return times[(int)(p * (n - 1) + 0.5)];
+}
+
+static void add_sample(float *times, int *n, double seconds) {
+  if (*n < PAINT_SAMPLES)
+    times[(*n)++] = seconds * 1e6;
+}
+
+/* Print the median, 99th percentile and maximum of the n times as
+ * name_us_p50=... */
+static void print_percentiles(const char *name, float *times, int n) {
+  qsort(times, n, sizeof(float), compare_times);
+  fprintf(stderr, " %s_us_p50=%.1f %s_us_p99=%.1f %s_us_max=%.1f", name,
+          percentile(times, n, 0.5), name, percentile(times, n, 0.99), name,
+          percentile(times, n, 1));
+}
+
+static resource **find_resource(XID id) {
+  resource **r;
+
+  for (r = &resources[id % RESOURCE_BUCKETS]; *r; r = &(*r)->next)
+    if ((*r)->id == id)
+      break;
+  return r;
+}
+
+static resource *add_resource(XID id) {
+  resource **p = find_resource(id), *r = *p;
+
+  if (!r) {
+    r = calloc(1, sizeof(resource));
+    if (!r)
+      return NULL;
+    r->id = id;
+    r->kind = ResOther;
+    *p = r;
   }
-  /*
-   * Build the gaussian in sections
-   */
+  return r;
+}
 
-  /*
-   * center (fill the complete data array)
-   */
-  if (Gsize > 0)
-    d = shadowTop[opacity_int * (Gsize + 1) + Gsize];
-  else
-    d = sum_gaussian(gaussianMap, opacity, center, center, width, height);
-  memset(data, d, sheight * swidth);
+/* Say what the resource id just created is for, before the request is sent,
+ * and how much memory it holds if the request does not tell */
+static void label_resource(XID id, ResourceKind kind, unsigned long bytes) {
+  resource *r;
 
-  /*
-   * corners
-   */
-  ylimit = gsize;
-  if (ylimit > sheight / 2)
-    ylimit = (sheight + 1) / 2;
-  xlimit = gsize;
-  if (xlimit > swidth / 2)
-    xlimit = (swidth + 1) / 2;
-
-  for (y = 0; y < ylimit; y++)
-    for (x = 0; x < xlimit; x++) {
-      if (xlimit == Gsize && ylimit == Gsize)
-        d = shadowCorner[opacity_int * (Gsize + 1) * (Gsize + 1) +
-                         y * (Gsize + 1) + x];
-      else
-        d = sum_gaussian(gaussianMap, opacity, x - center, y - center, width,
-                         height);
-      data[y * swidth + x] = d;
-      data[(sheight - y - 1) * swidth + x] = d;
-      data[(sheight - y - 1) * swidth + (swidth - x - 1)] = d;
-      data[y * swidth + (swidth - x - 1)] = d;
+  if (!resourceInterval || !id)
+    return;
+  r = add_resource(id);
+  if (!r)
+    return;
+  r->kind = kind;
+  if (bytes)
+    r->bytes = bytes;
+}
+
+static void free_resource(XID id) {
+  resource **p = find_resource(id), *r = *p;
+
+  if (!r)
+    return;
+  *p = r->next;
+  /* pictures keep the pixmap they were made from; the picture may be gone
+   * already, or its id reused for another drawable */
+  if (r->type == ResTypePixmap && r->picture) {
+    resource *pict = *find_resource(r->picture);
+
+    if (pict && pict->type == ResTypePicture && pict->drawable == id)
+      pict->bytes += r->bytes;
+  }
+  free(r);
+}
+
+static XID request_xid(const unsigned char *request, int offset) {
+  uint32_t id;
+
+  memcpy(&id, request + offset, sizeof(id));
+  return id;
+}
+
+/* Bytes of a pixmap as X-Resource estimates them */
+static unsigned long pixmap_bytes(int width, int height, int depth) {
+  int bpp = depth == 1 ? 1 : depth <= 8 ? 8 : depth <= 16 ? 16 : 32;
+
+  return (unsigned long)width * height * bpp / 8;
+}
+
+/* Keep track of the server resources that the len bytes of request create
+ * or free */
+static void count_resources(const unsigned char *request, long len) {
+  int major = request[0], minor = request[1];
+  int type = -1, live = 0;
+  XID id, drawable = None;
+  unsigned long bytes = 0;
+  resource *r;
+
+  if (major == X_CreatePixmap || major == X_FreePixmap) {
+    type = ResTypePixmap;
+    live = major == X_CreatePixmap ? 1 : -1;
+    if (live > 0 && len >= 16) {
+      uint16_t width, height;
+      memcpy(&width, request + 12, sizeof(width));
+      memcpy(&height, request + 14, sizeof(height));
+      bytes = pixmap_bytes(width, height, request[1]);
     }
+  } else if (major == render_opcode) {
+    type = ResTypePicture;
+    if (minor == X_RenderCreatePicture ||
+        (minor >= X_RenderCreateSolidFill &&
+         minor <= X_RenderCreateConicalGradient))
+      live = 1;
+    else if (minor == X_RenderFreePicture)
+      live = -1;
+    if (minor == X_RenderCreatePicture && len >= 12)
+      drawable = request_xid(request, 8);
+  } else if (major == xfixes_opcode) {
+    type = ResTypeRegion;
+    if (minor >= X_XFixesCreateRegion &&
+        minor <= X_XFixesCreateRegionFromPicture)
+      live = 1;
+    else if (minor == X_XFixesDestroyRegion)
+      live = -1;
+  } else if (major == damage_opcode) {
+    type = ResTypeDamage;
+    if (minor == X_DamageCreate)
+      live = 1;
+    else if (minor == X_DamageDestroy)
+      live = -1;
+  } else if (major == composite_opcode &&
+             minor == X_CompositeNameWindowPixmap) {
+    type = ResTypePixmap;
+    live = 1;
+  }
+  if (!live)
+    return;
+  switch (type) {
+  case ResTypePixmap:
+    pageStats.live_pixmaps += live;
+    break;
+  case ResTypePicture:
+    pageStats.live_pictures += live;
+    break;
+  case ResTypeRegion:
+    pageStats.live_regions += live;
+    break;
+  case ResTypeDamage:
+    pageStats.live_damages += live;
+    break;
+  }
 
-  /*
-   * top/bottom
-   */
-  x_diff = swidth - (gsize * 2);
-  if (x_diff > 0 && ylimit > 0) {
-    for (y = 0; y < ylimit; y++) {
-      if (ylimit == Gsize)
-        d = shadowTop[opacity_int * (Gsize + 1) + y];
-      else
-        d = sum_gaussian(gaussianMap, opacity, center, y - center, width,
-                         height);
-      memset(&data[y * swidth + gsize], d, x_diff);
-      memset(&data[(sheight - y - 1) * swidth + gsize], d, x_diff);
+  if (!resourceInterval || len < 8)
+    return;
+  /* the new pixmap of NameWindowPixmap comes after the window */
+  id = request_xid(request, major == composite_opcode ? 8 : 4);
+  if (live < 0) {
+    free_resource(id);
+    return;
+  }
+  r = add_resource(id);
+  if (!r)
+    return;
+  r->type = type;
+  r->drawable = drawable;
+  if (bytes)
+    r->bytes = bytes;
+  if (drawable) {
+    resource *pixmap = *find_resource(drawable);
+
+    if (pixmap && pixmap->type == ResTypePixmap)
+      pixmap->picture = id;
+  }
+  if (r->kind == ResOther && type == ResTypeRegion)
+    r->kind = ResRegion;
+  else if (r->kind == ResOther && type == ResTypeDamage)
+    r->kind = ResDamage;
+}
+
+/* Count the requests in each buffer Xlib sends to the server. Requests sent
+ * through xcb, such as the frame fence and the pipelined window queries,
+ * never pass through here, which the names of the counters say. */
+static void count_requests(Display *dpy, XExtCodes *codes, _Xconst char *data,
+                           long len) {
+  const unsigned char *p = (const unsigned char *)data;
+  const unsigned char *end = p + len;
+
+  frameStats.request_bytes += len;
+  while (p < end) {
+    unsigned long size;
+    uint16_t length16;
+    uint32_t length32;
+
+    if (requestSkip) {
+      unsigned long n = (unsigned long)(end - p);
+      if (n > requestSkip)
+        n = requestSkip;
+      p += n;
+      requestSkip -= n;
+      continue;
     }
+    if (end - p < 4)
+      break;
+    memcpy(&length16, p + 2, sizeof(length16));
+    size = length16 * 4;
+    if (!size) {
+      /* BIG-REQUESTS: the length follows in the next 4 bytes */
+      if (end - p < 8)
+        break;
+      memcpy(&length32, p + 4, sizeof(length32));
+      size = (unsigned long)length32 * 4;
+    }
+    if (p[0] < 128 || p[1] >= MAX_MINOR_OPCODE)
+      opcodeCounts[p[0]][0]++;
+    else
+      opcodeCounts[p[0]][p[1]]++;
+    count_resources(p, end - p);
+    if (size < 4)
+      break;
+    if (size > (unsigned long)(end - p)) {
+      requestSkip = size - (end - p);
+      break;
+    }
+    p += size;
   }
+}
 
-  /*
-   * sides
-   */
+static void account_requests(Display *dpy) {
+  static const char *names[] = {"RENDER", "XFIXES", "DAMAGE", COMPOSITE_NAME,
+                                "SHAPE"};
+  int *opcodes[] = {&render_opcode, &xfixes_opcode, &damage_opcode, NULL,
+                    NULL};
+  XExtCodes *codes = XAddExtension(dpy);
+  unsigned int i;
+
+  if (!codes)
+    return;
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    int major, event, error;
+    if (XQueryExtension(dpy, names[i], &major, &event, &error)) {
+      extensionNames[major] = names[i];
+      if (opcodes[i])
+        *opcodes[i] = major;
+    }
+  }
+  XESetBeforeFlush(dpy, codes->extension, count_requests);
+}
 
-  for (x = 0; x < xlimit; x++) {
-    if (xlimit == Gsize)
-      d = shadowTop[opacity_int * (Gsize + 1) + x];
+/* Print the opcodes used since the last report, most used first, as
+ * xlib_requests_by_opcode=NAME.minor:count,... where core requests are named
+ * core.major
+ */
+static void print_opcodes(void) {
+  const char *sep = "";
+  int major, minor;
+
+  fprintf(stderr, " xlib_requests_by_opcode=");
+  for (;;) {
+    unsigned long most = 0;
+    int most_major = 0, most_minor = 0;
+    for (major = 0; major < 256; major++)
+      for (minor = 0; minor < MAX_MINOR_OPCODE; minor++)
+        if (opcodeCounts[major][minor] > most) {
+          most = opcodeCounts[major][minor];
+          most_major = major;
+          most_minor = minor;
+        }
+    if (!most)
+      break;
+    if (most_major < 128)
+      fprintf(stderr, "%score.%d:%lu", sep, most_major, most);
+    else if (extensionNames[most_major])
+      fprintf(stderr, "%s%s.%d:%lu", sep, extensionNames[most_major],
+              most_minor, most);
     else
-      d = sum_gaussian(gaussianMap, opacity, x - center, center, width, height);
-    for (y = gsize; y < sheight - gsize; y++) {
-      data[y * swidth + x] = d;
-      data[y * swidth + (swidth - x - 1)] = d;
+      fprintf(stderr, "%s%d.%d:%lu", sep, most_major, most_minor, most);
+    opcodeCounts[most_major][most_minor] = 0;
+    sep = ",";
+  }
+}
+
+/* the --stats-page histogram bucket of a frame that took us to paint */
+static int paint_bucket(double us) {
+  int i = 0;
+
+  while (us >= 32 && i < STATS_PAINT_BUCKETS - 1) {
+    us /= 2;
+    i++;
+  }
+  return i;
+}
+
+static void open_stats_page(const char *path) {
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+  if (fd < 0 || ftruncate(fd, sizeof(stats_page)) < 0) {
+    perror(path);
+    exit(1);
+  }
+  statsPage = mmap(NULL, sizeof(stats_page), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+  close(fd);
+  if (statsPage == MAP_FAILED) {
+    perror(path);
+    exit(1);
+  }
+  statsPage->magic = DIAGONATOR_STATS_MAGIC;
+  statsPage->version = DIAGONATOR_STATS_VERSION;
+  statsPage->size = sizeof(stats_page);
+}
+
+/* Copy the counters to the stats page, odd sequence numbers marking the
+ * copy as in progress for readers
+ */
+static void publish_stats(void) {
+  uint32_t sequence;
+  win *w;
+  fade *f;
+
+  if (!statsPage)
+    return;
+  pageStats.round_trips += frameStats.round_trips - pageRoundTrips;
+  pageRoundTrips = frameStats.round_trips;
+  pageStats.windows = pageStats.mapped_windows = 0;
+  for (w = list; w; w = w->next) {
+    pageStats.windows++;
+    if (w->a.map_state == IsViewable)
+      pageStats.mapped_windows++;
+  }
+  pageStats.fades = 0;
+  for (f = fades; f; f = f->next)
+    pageStats.fades++;
+  pageStats.cpu_seconds = cpu_time();
+  pageStats.updated_ms = wall_time() * 1000;
+
+  sequence = statsPage->sequence;
+  __atomic_store_n(&statsPage->sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(&statsPage->counters, &pageStats, sizeof(pageStats));
+  __atomic_store_n(&statsPage->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/* Print the counters gathered since the last report as key=value pairs */
+static void run_stats(void) {
+  int now = get_time_in_milliseconds();
+  stats *s = &frameStats;
+
+  if (!statsInterval || stats_time - now > 0)
+    return;
+  qsort(paintTimes, n_paint_times, sizeof(float), compare_times);
+  fprintf(stderr, "stats interval_ms=%d paint_us_p50=%.1f paint_us_p99=%.1f ",
+          now - stats_start, percentile(paintTimes, n_paint_times, 0.5),
+          percentile(paintTimes, n_paint_times, 0.99));
+  fprintf(stderr,
+          "frames=%lu cpu_us_per_frame=%.1f requests_per_frame=%.1f "
+          "scroll_frames=%lu scroll_cpu_us_per_frame=%.1f "
+          "scroll_requests_per_frame=%.1f shadow_cache_hits=%lu "
+          "shadow_cache_misses=%lu shadow_cache_bytes=%lu "
+          "configure_events=%lu configures_flushed=%lu damage_events=%lu "
+          "damage_requests_per_frame=%.1f damage_rects_in=%lu "
+          "damage_rects_out=%lu damage_overdraw=%ld ignore_allocs=%lu "
+          "round_trips_per_frame=%.1f shadow_jobs=%lu "
+          "region_creates_per_frame=%.1f region_destroys_per_frame=%.1f "
+          "region_reuses_per_frame=%.1f xlib_request_bytes_per_frame=%.1f",
+          s->frames, per_frame(s->paint_cpu * 1e6, s->frames),
+          per_frame(s->paint_requests, s->frames), s->scroll_frames,
+          per_frame(s->scroll_cpu * 1e6, s->scroll_frames),
+          per_frame(s->scroll_requests, s->scroll_frames),
+          s->shadow_cache_hits, s->shadow_cache_misses, shadowCacheBytes,
+          s->configure_events, s->configures_flushed, s->damage_events,
+          per_frame(s->damage_requests, s->frames), s->damage_rects_in,
+          s->damage_rects_out, s->damage_overdraw, s->ignore_allocs,
+          per_frame(s->round_trips, s->frames), s->shadow_jobs,
+          per_frame(s->region_creates, s->frames),
+          per_frame(s->region_destroys, s->frames),
+          per_frame(s->region_reuses, s->frames),
+          per_frame(s->request_bytes, s->frames));
+  if (latencyProbe) {
+    print_percentiles("draw_latency", drawLatencies, n_draw_latencies);
+    print_percentiles("damage_latency", damageLatencies, n_damage_latencies);
+    n_draw_latencies = n_damage_latencies = 0;
+  }
+  print_opcodes();
+  fputc('\n', stderr);
+  publish_stats();
+  memset(s, 0, sizeof(stats));
+  pageRoundTrips = 0;
+  n_paint_times = 0;
+  stats_start = now;
+  stats_time = now + statsInterval;
+}
+
+static int resources_timeout(void) {
+  int delta;
+  if (!resourceInterval)
+    return -1;
+  delta = resources_time - get_time_in_milliseconds();
+  if (delta < 0)
+    delta = 0;
+  return delta;
+}
+
+/* Print what the server holds for diagonator by kind, as kind=count:bytes,
+ * next to what X-Resource says it holds, and any difference in the number
+ * of resources of each type
+ */
+static void run_resources(Display *dpy) {
+  int now = get_time_in_milliseconds();
+  unsigned long counts[NumResourceKinds] = {0}, bytes[NumResourceKinds] = {0};
+  unsigned long types[NumResourceTypes] = {0}, total = 0;
+  int b, k, t;
+
+  if (!resourceInterval || resources_time - now > 0)
+    return;
+  for (b = 0; b < RESOURCE_BUCKETS; b++) {
+    resource *r;
+    for (r = resources[b]; r; r = r->next) {
+      counts[r->kind]++;
+      bytes[r->kind] += r->bytes;
+      types[r->type]++;
+      total += r->bytes;
+    }
+  }
+  fprintf(stderr, "resources");
+  for (k = 0; k < NumResourceKinds; k++)
+    fprintf(stderr, " %s=%lu:%lu", resourceKindNames[k], counts[k], bytes[k]);
+  fprintf(stderr, " bytes=%lu", total);
+  if (hasXRes) {
+    unsigned long xres_bytes = 0;
+    unsigned long xres_types[NumResourceTypes] = {0};
+    XResType *xres;
+    int n, i;
+    const char *sep = " mismatch=";
+
+    frameStats.round_trips += 2;
+    if (XResQueryClientPixmapBytes(dpy, rootPicture, &xres_bytes))
+      fprintf(stderr, " xres_pixmap_bytes=%lu", xres_bytes);
+    if (XResQueryClientResources(dpy, rootPicture, &n, &xres)) {
+      for (i = 0; i < n; i++)
+        for (t = 0; t < NumResourceTypes; t++)
+          if (xres[i].resource_type == resourceTypeAtoms[t])
+            xres_types[t] = xres[i].count;
+      XFree(xres);
+      for (t = 0; t < NumResourceTypes; t++)
+        if (types[t] != xres_types[t]) {
+          fprintf(stderr, "%s%s:%lu/%lu", sep, resourceTypeNames[t], types[t],
+                  xres_types[t]);
+          sep = ",";
+        }
     }
   }
+  fputc('\n', stderr);
+  resources_time = now + resourceInterval;
+}
 
-  return ximage;
+/* how long poll may sleep before one of the timers is due */
+static int next_timeout(void) {
+  int timeouts[] = {fade_timeout(), scroll_timeout(), stats_timeout(),
+                    resources_timeout()};
+  int timeout = -1;
+  unsigned int i;
+
+  for (i = 0; i < sizeof(timeouts) / sizeof(timeouts[0]); i++)
+    if (timeouts[i] >= 0 && (timeout < 0 || timeouts[i] < timeout))
+      timeout = timeouts[i];
+  return timeout;
 }
 
-static Picture shadow_picture(Display *dpy, double opacity, Picture alpha_pict,
-                              int width, int height, int *wp, int *hp) {
+/* Upload the shadow made by make_shadow_data, which takes over data */
+static Picture upload_shadow(Display *dpy, unsigned char *data, int swidth,
+                             int sheight) {
   XImage *shadowImage;
   Pixmap shadowPixmap;
   Picture shadowPicture;
   GC gc;
 
-  shadowImage = make_shadow(dpy, opacity, width, height);
-  if (!shadowImage)
+  shadowImage = XCreateImage(dpy, DefaultVisual(dpy, DefaultScreen(dpy)), 8,
+                             ZPixmap, 0, (char *)data, swidth, sheight, 8,
+                             swidth * sizeof(unsigned char));
+  if (!shadowImage) {
+    free(data);
     return None;
+  }
   shadowPixmap =
       XCreatePixmap(dpy, root, shadowImage->width, shadowImage->height, 8);
   if (!shadowPixmap) {
     XDestroyImage(shadowImage);
     return None;
   }
+  label_resource(shadowPixmap, ResShadow, 0);
 
   shadowPicture = XRenderCreatePicture(
       dpy, shadowPixmap, XRenderFindStandardFormat(dpy, PictStandardA8), 0,
       NULL);
+  label_resource(shadowPicture, ResShadow, 0);
   if (!shadowPicture) {
     XDestroyImage(shadowImage);
     XFreePixmap(dpy, shadowPixmap);
@@ -616,14 +1421,189 @@ static Picture shadow_picture(Display *dpy, double opacity, Picture alpha_pict,
 
   XPutImage(dpy, shadowPixmap, gc, shadowImage, 0, 0, 0, 0, shadowImage->width,
             shadowImage->height);
-  *wp = shadowImage->width;
-  *hp = shadowImage->height;
   XFreeGC(dpy, gc);
   XDestroyImage(shadowImage);
   XFreePixmap(dpy, shadowPixmap);
   return shadowPicture;
 }
 
+static Picture shadow_picture(Display *dpy, double opacity, Picture alpha_pict,
+                              int width, int height, int *wp, int *hp) {
+  int swidth, sheight;
+  uint64_t traced = trace_clock();
+  unsigned char *data =
+      make_shadow_data(shadowTables, opacity, width, height, &swidth, &sheight);
+  Picture shadowPicture;
+
+  if (!data)
+    return None;
+  shadowPicture = upload_shadow(dpy, data, swidth, sheight);
+  if (shadowPicture) {
+    *wp = swidth;
+    *hp = sheight;
+  }
+  PROBE2(shadow_picture, swidth, sheight);
+  trace(TraceShadow, traced, (long)width * height);
+  return shadowPicture;
+}
+
+static void *shadow_worker(void *arg) {
+  shadow_job *job;
+  uint64_t traced;
+
+  traceThread = (int)(intptr_t)arg;
+  for (;;) {
+    pthread_mutex_lock(&shadowLock);
+    while (!shadowJobs)
+      pthread_cond_wait(&shadowCond, &shadowLock);
+    job = shadowJobs;
+    shadowJobs = job->next;
+    pthread_mutex_unlock(&shadowLock);
+
+    traced = trace_clock();
+    job->data = make_shadow_data(shadowTables, job->opacity, job->width,
+                                 job->height, &job->swidth, &job->sheight);
+    trace(TraceShadow, traced, (long)job->width * job->height);
+
+    pthread_mutex_lock(&shadowLock);
+    job->next = shadowResults;
+    shadowResults = job;
+    pthread_mutex_unlock(&shadowLock);
+    while (write(shadowPipe[1], "", 1) < 0 && errno == EINTR)
+      ;
+  }
+  return NULL;
+}
+
+/* Start the shadow workers, or leave shadows to the main thread if that
+ * fails */
+static void start_shadow_workers(void) {
+  pthread_t thread;
+  int i, started = 0;
+
+  if (shadowThreads <= 0 || pipe(shadowPipe) < 0)
+    return;
+  fcntl(shadowPipe[0], F_SETFL, O_NONBLOCK);
+  for (i = 0; i < shadowThreads; i++)
+    if (!pthread_create(&thread, NULL, shadow_worker,
+                        (void *)(intptr_t)(started + 1))) {
+      pthread_detach(thread);
+      started++;
+    }
+  if (!started) {
+    close(shadowPipe[0]);
+    close(shadowPipe[1]);
+    shadowPipe[0] = shadowPipe[1] = -1;
+  }
+  shadowThreads = started;
+}
+
+/* Have a worker make the shadow of w, instead of any shadow of w still
+ * waiting for one. The window has no shadow until collect_shadows finds the
+ * result. */
+static Bool queue_shadow(win *w, double opacity, int width, int height) {
+  shadow_job *job, **prev;
+
+  if (shadowPipe[0] < 0)
+    return False;
+  job = malloc(sizeof(shadow_job));
+  if (!job)
+    return False;
+  job->id = w->id;
+  job->opacity = opacity;
+  job->width = width;
+  job->height = height;
+  job->data = NULL;
+  pthread_mutex_lock(&shadowLock);
+  for (prev = &shadowJobs; *prev;) {
+    shadow_job *old = *prev;
+
+    if (old->id == w->id) {
+      *prev = old->next;
+      free(old);
+    } else
+      prev = &old->next;
+  }
+  job->next = shadowJobs;
+  shadowJobs = job;
+  pthread_cond_signal(&shadowCond);
+  pthread_mutex_unlock(&shadowLock);
+  w->shadow_pending = True;
+  frameStats.shadow_jobs++;
+  return True;
+}
+
+/* Free w's shadow, which no other window is likely to need */
+static void free_shadow(Display *dpy, win *w) {
+  if (w->shadow) {
+    XRenderFreePicture(dpy, w->shadow);
+    w->shadow = None;
+  }
+}
+
+/* Keep w's shadow for another window of the same size and opacity, such as
+ * w itself when it is mapped again after a workspace switch. The least
+ * recently used shadows are freed to stay within shadowCacheLimit bytes.
+ */
+static void release_shadow(Display *dpy, win *w) {
+  cached_shadow *c;
+  cached_shadow **prev;
+  unsigned long total = 0;
+
+  if (!w->shadow)
+    return;
+  c = malloc(sizeof(cached_shadow));
+  if (!c || (unsigned long)w->shadow_width * w->shadow_height >
+                shadowCacheLimit) {
+    free(c);
+    XRenderFreePicture(dpy, w->shadow);
+    w->shadow = None;
+    return;
+  }
+  c->for_width = w->shadow_for_width;
+  c->for_height = w->shadow_for_height;
+  c->for_opacity = w->shadow_for_opacity;
+  c->shadow = w->shadow;
+  c->width = w->shadow_width;
+  c->height = w->shadow_height;
+  c->next = shadowCache;
+  shadowCache = c;
+  w->shadow = None;
+
+  for (prev = &shadowCache; (c = *prev);) {
+    total += (unsigned long)c->width * c->height;
+    if (total > shadowCacheLimit) {
+      total -= (unsigned long)c->width * c->height;
+      *prev = c->next;
+      XRenderFreePicture(dpy, c->shadow);
+      free(c);
+    } else
+      prev = &c->next;
+  }
+  shadowCacheBytes = total;
+}
+
+static Bool take_cached_shadow(win *w, int width, int height,
+                               double opacity) {
+  cached_shadow *c;
+  cached_shadow **prev;
+
+  for (prev = &shadowCache; (c = *prev); prev = &c->next)
+    if (c->for_width == width && c->for_height == height &&
+        c->for_opacity == opacity) {
+      *prev = c->next;
+      shadowCacheBytes -= (unsigned long)c->width * c->height;
+      w->shadow = c->shadow;
+      w->shadow_width = c->width;
+      w->shadow_height = c->height;
+      free(c);
+      frameStats.shadow_cache_hits++;
+      return True;
+    }
+  frameStats.shadow_cache_misses++;
+  return False;
+}
+
 static Picture solid_picture(Display *dpy, Bool argb, double a, double r,
                              double g, double b) {
   Pixmap pixmap;
@@ -634,6 +1614,7 @@ static Picture solid_picture(Display *dpy, Bool argb, double a, double r,
   pixmap = XCreatePixmap(dpy, root, 1, 1, argb ? 32 : 8);
   if (!pixmap)
     return None;
+  label_resource(pixmap, ResSolid, 0);
 
   pa.repeat = True;
   picture =
@@ -641,6 +1622,7 @@ static Picture solid_picture(Display *dpy, Bool argb, double a, double r,
                            XRenderFindStandardFormat(
                                dpy, argb ? PictStandardARGB32 : PictStandardA8),
                            CPRepeat, &pa);
+  label_resource(picture, ResSolid, 0);
   if (!picture) {
     XFreePixmap(dpy, pixmap);
     return None;
@@ -655,32 +1637,80 @@ static Picture solid_picture(Display *dpy, Bool argb, double a, double r,
   return picture;
 }
 
+#define IGNORE(i) (ignores[(ignore_start + (i)) % ignore_size])
+
 static void discard_ignore(Display *dpy, unsigned long sequence) {
-  while (ignore_head) {
-    if ((long)(sequence - ignore_head->sequence) > 0) {
-      ignore *next = ignore_head->next;
-      free(ignore_head);
-      ignore_head = next;
-      if (!ignore_head)
-        ignore_tail = &ignore_head;
+  while (ignore_count) {
+    if (ignoreBatch && ignore_count == 1)
+      break;
+    if ((long)(sequence - IGNORE(0).last) > 0) {
+      ignore_start = (ignore_start + 1) % ignore_size;
+      ignore_count--;
     } else
       break;
   }
 }
 
+static void push_ignore(unsigned long first, unsigned long last) {
+  if (ignore_count) {
+    ignore *i = &IGNORE(ignore_count - 1);
+    if ((long)(first - i->last) <= 1) {
+      if ((long)(last - i->last) > 0)
+        i->last = last;
+      return;
+    }
+  }
+  if (ignore_count == ignore_size) {
+    int size = ignore_size ? ignore_size * 2 : 64;
+    ignore *n = malloc(size * sizeof(ignore));
+    int i;
+    if (!n)
+      return;
+    for (i = 0; i < ignore_count; i++)
+      n[i] = IGNORE(i);
+    free(ignores);
+    ignores = n;
+    ignore_start = 0;
+    ignore_size = size;
+    frameStats.ignore_allocs++;
+  }
+  IGNORE(ignore_count).first = first;
+  IGNORE(ignore_count).last = last;
+  ignore_count++;
+}
+
 static void set_ignore(Display *dpy, unsigned long sequence) {
-  ignore *i = malloc(sizeof(ignore));
-  if (!i)
+  if (!ignoreBatch)
+    push_ignore(sequence, sequence);
+}
+
+/* Ignore errors from every request sent until the matching end_ignore */
+static void begin_ignore(Display *dpy) {
+  if (ignoreBatch)
+    return;
+  push_ignore(NextRequest(dpy), NextRequest(dpy));
+  ignoreBatch = True;
+}
+
+static void end_ignore(Display *dpy) {
+  if (!ignoreBatch)
     return;
-  i->sequence = sequence;
-  i->next = NULL;
-  *ignore_tail = i;
-  ignore_tail = &i->next;
+  ignoreBatch = False;
+  if (ignore_count &&
+      (long)(NextRequest(dpy) - 1 - IGNORE(ignore_count - 1).last) > 0)
+    IGNORE(ignore_count - 1).last = NextRequest(dpy) - 1;
 }
 
 static int should_ignore(Display *dpy, unsigned long sequence) {
+  ignore *i;
+
   discard_ignore(dpy, sequence);
-  return ignore_head && ignore_head->sequence == sequence;
+  if (!ignore_count)
+    return False;
+  i = &IGNORE(0);
+  if (ignoreBatch && ignore_count == 1)
+    return (long)(sequence - i->first) >= 0;
+  return (long)(sequence - i->first) >= 0 && (long)(i->last - sequence) >= 0;
 }
 
 static win *find_win(Display *dpy, Window id) {
@@ -726,12 +1756,25 @@ static Picture root_tile(Display *dpy) {
   }
   if (!pixmap) {
     pixmap = XCreatePixmap(dpy, root, 1, 1, DefaultDepth(dpy, scr));
+    label_resource(pixmap, ResBackground, 0);
     fill = True;
   }
   pa.repeat = True;
   picture = XRenderCreatePicture(
       dpy, pixmap, XRenderFindVisualFormat(dpy, DefaultVisual(dpy, scr)),
       CPRepeat, &pa);
+  if (!fill && resourceInterval) {
+    /* the wallpaper belongs to another client, but the picture keeps it */
+    Window r;
+    int x, y;
+    unsigned int width, height, border, depth;
+    frameStats.round_trips++;
+    if (XGetGeometry(dpy, pixmap, &r, &x, &y, &width, &height, &border,
+                     &depth))
+      label_resource(picture, ResBackground,
+                     pixmap_bytes(width, height, depth));
+  } else
+    label_resource(picture, ResBackground, 0);
   if (fill) {
     XRenderColor c;
 
@@ -750,6 +1793,47 @@ static void paint_root(Display *dpy) {
                    root_width, root_height);
 }
 
+/* Take a region from the pool and set it to rects, or create one */
+static XserverRegion new_region(Display *dpy, XRectangle *rects, int n) {
+  XserverRegion region;
+
+  if (!n_region_pool) {
+    frameStats.region_creates++;
+    return XFixesCreateRegion(dpy, rects, n);
+  }
+  region = regionPool[--n_region_pool];
+  XFixesSetRegion(dpy, region, rects, n);
+  frameStats.region_reuses++;
+  return region;
+}
+
+static XserverRegion copy_region(Display *dpy, XserverRegion src) {
+  XserverRegion region;
+
+  if (n_region_pool) {
+    region = regionPool[--n_region_pool];
+    frameStats.region_reuses++;
+  } else {
+    region = XFixesCreateRegion(dpy, NULL, 0);
+    frameStats.region_creates++;
+  }
+  XFixesCopyRegion(dpy, region, src);
+  return region;
+}
+
+/* Put a region made by new_region or copy_region back in the pool. Regions
+ * from XFixesCreateRegionFromWindow may be invalid when the window is gone,
+ * so they are destroyed directly instead.
+ */
+static void free_region(Display *dpy, XserverRegion region) {
+  if (n_region_pool < REGION_POOL_SIZE) {
+    regionPool[n_region_pool++] = region;
+    return;
+  }
+  XFixesDestroyRegion(dpy, region);
+  frameStats.region_destroys++;
+}
+
 static XserverRegion win_extents(Display *dpy, win *w) {
   XRectangle r;
 
@@ -772,13 +1856,26 @@ static XserverRegion win_extents(Display *dpy, win *w) {
         w->shadow_dy = shadowOffsetY;
         if (!w->shadow) {
           double opacity = shadowOpacity;
+          int width = w->a.width + w->a.border_width * 2;
+          int height = w->a.height + w->a.border_width * 2;
           if (w->mode == WINDOW_TRANS)
             opacity = opacity * ((double)w->opacity) / ((double)OPAQUE);
-          w->shadow = shadow_picture(dpy, opacity, w->alphaPict,
-                                     w->a.width + w->a.border_width * 2,
-                                     w->a.height + w->a.border_width * 2,
-                                     &w->shadow_width, &w->shadow_height);
+          if (w->shadow_pending && w->shadow_for_width == width &&
+              w->shadow_for_height == height &&
+              w->shadow_for_opacity == opacity)
+            ;
+          else if (!take_cached_shadow(w, width, height, opacity) &&
+                   !queue_shadow(w, opacity, width, height))
+            w->shadow = shadow_picture(dpy, opacity, w->alphaPict, width,
+                                       height, &w->shadow_width,
+                                       &w->shadow_height);
+          w->shadow_for_width = width;
+          w->shadow_for_height = height;
+          w->shadow_for_opacity = opacity;
         }
+        /* no shadow while a worker is still making it */
+        if (!w->shadow)
+          return new_region(dpy, &r, 1);
       }
       sr.x = w->a.x + w->shadow_dx;
       sr.y = w->a.y + w->shadow_dy;
@@ -798,7 +1895,7 @@ static XserverRegion win_extents(Display *dpy, win *w) {
         r.height = sr.y + sr.height - r.y;
     }
   }
-  return XFixesCreateRegion(dpy, &r, 1);
+  return new_region(dpy, &r, 1);
 }
 
 static XserverRegion border_size(Display *dpy, win *w) {
@@ -819,17 +1916,165 @@ static XserverRegion border_size(Display *dpy, win *w) {
   return border;
 }
 
+/* the area inside the margins, which is where the lines are drawn */
+static Bool overlay_rect(XRectangle *r) {
+  int width = root_width - DIAGONATOR_LEFT_MARGIN - DIAGONATOR_RIGHT_MARGIN;
+  int height = root_height - DIAGONATOR_TOP_MARGIN - DIAGONATOR_BOTTOM_MARGIN;
+
+  if (width <= 0 || height <= 0)
+    return False;
+  r->x = DIAGONATOR_LEFT_MARGIN;
+  r->y = DIAGONATOR_TOP_MARGIN;
+  r->width = width;
+  r->height = height;
+  return True;
+}
+
+static int overlay_alpha_level(void) {
+  return (int)(overlayOpacity * (OVERLAY_ALPHA_LEVELS - 1) + 0.5);
+}
+
+static void paint_overlay(Display *dpy, Picture dst) {
+  int level = overlay_alpha_level();
+  overlay_level *ol = &overlayLevels[overlayLevel];
+  Picture mask = None;
+  int src_x = 0, src_y = 0;
+  XRectangle r;
+
+  if (level == 0 || !overlay_rect(&r))
+    return;
+  if (!ol->picture)
+    build_overlay_levels(dpy);
+  if (level < OVERLAY_ALPHA_LEVELS - 1) {
+    if (!overlayAlpha[level])
+      overlayAlpha[level] = solid_picture(
+          dpy, False, (double)level / (OVERLAY_ALPHA_LEVELS - 1), 0, 0, 0);
+    mask = overlayAlpha[level];
+  }
+  if (ol->tile_width) {
+    src_x = (scrollX % ol->tile_width + ol->tile_width) % ol->tile_width;
+    src_y = (scrollY % ol->tile_height + ol->tile_height) % ol->tile_height;
+  }
+  XRenderComposite(dpy, PictOpOver, ol->picture, mask, dst, src_x, src_y, 0, 0,
+                   r.x, r.y, r.width, r.height);
+}
+
+static void free_background(Display *dpy) {
+  if (backgroundPicture) {
+    XRenderFreePicture(dpy, backgroundPicture);
+    backgroundPicture = None;
+  }
+}
+
+/* Paint the root window. With --cache-background, and while the lines are
+ * neither fading nor scrolling, this is a single PictOpSrc composite of the
+ * wallpaper with the lines already applied, and True is returned so that the
+ * lines aren't painted over the root window again. The cached picture is
+ * rebuilt when the wallpaper or the lines change. It has the lines
+ * everywhere, so it is only used when opaque is set: nothing painted over
+ * the root window this frame lets it show through, and no lines are kept
+ * off any window.
+ */
+static Bool paint_background(Display *dpy, Bool opaque) {
+  overlay_level *ol = &overlayLevels[overlayLevel];
+
+  if (!cacheBackground || !opaque || rootBuffer == rootPicture ||
+      overlayOpacity != overlayTarget ||
+      (DIAGONATOR_SCROLL_SPEED != 0 && ol->tile_width)) {
+    paint_root(dpy);
+    return False;
+  }
+  if (backgroundLevel != overlayLevel ||
+      backgroundAlpha != overlay_alpha_level())
+    free_background(dpy);
+  if (!backgroundPicture) {
+    Pixmap pixmap = XCreatePixmap(dpy, root, root_width, root_height,
+                                  DefaultDepth(dpy, scr));
+    label_resource(pixmap, ResBackground, 0);
+    backgroundPicture = XRenderCreatePicture(
+        dpy, pixmap, XRenderFindVisualFormat(dpy, DefaultVisual(dpy, scr)), 0,
+        NULL);
+    label_resource(backgroundPicture, ResBackground, 0);
+    XFreePixmap(dpy, pixmap);
+    if (!rootTile)
+      rootTile = root_tile(dpy);
+    XRenderComposite(dpy, PictOpSrc, rootTile, None, backgroundPicture, 0, 0,
+                     0, 0, 0, 0, root_width, root_height);
+    paint_overlay(dpy, backgroundPicture);
+    backgroundLevel = overlayLevel;
+    backgroundAlpha = overlay_alpha_level();
+  }
+  XRenderComposite(dpy, PictOpSrc, backgroundPicture, None, rootBuffer, 0, 0, 0,
+                   0, 0, 0, root_width, root_height);
+  return True;
+}
+
+static Bool above_overlay(win *w) {
+  int i;
+
+  for (i = 0; i < n_lines_below_types; i++)
+    if (w->windowType == linesBelowTypes[i])
+      return True;
+  return False;
+}
+
+/* Paint the lines into the part of clip that is not excluded, then free clip */
+static void paint_overlay_clipped(Display *dpy, XserverRegion clip) {
+  uint64_t traced = trace_clock();
+
+  if (exclusionChanged)
+    rebuild_exclusion(dpy);
+  if (rootBuffer != rootPicture) {
+    if (n_overlay_exclude)
+      XFixesSubtractRegion(dpy, clip, clip, overlayExclude);
+    XFixesSetPictureClipRegion(dpy, rootBuffer, 0, 0, clip);
+    paint_overlay(dpy, rootBuffer);
+  }
+  free_region(dpy, clip);
+  trace(TracePaintOverlay, traced, 0);
+}
+
+/* The number of rectangles in region, or 1 for the whole screen; fetching
+ * them takes a round trip, so this is only for tracers */
+static int region_rect_count(Display *dpy, XserverRegion region) {
+  XRectangle *rects;
+  int n;
+
+  if (!region)
+    return 1;
+  frameStats.round_trips++;
+  rects = XFixesFetchRegion(dpy, region, &n);
+  if (!rects)
+    return 0;
+  XFree(rects);
+  return n;
+}
+
+/* The lines are painted as a pseudo-layer in the stacking order, just below
+ * the windows at the top of the stack whose types are listed with
+ * --lines-below. Their clip is the damaged region that is left once the
+ * opaque windows above them have been subtracted, so none of the lines that
+ * are hidden by those windows are composited.
+ */
 static void paint_all(Display *dpy, XserverRegion region) {
   win *w;
   win *t = NULL;
-
+  XserverRegion overlayClip = None;
+  Bool above = True;
+  Bool opaque;
+  uint64_t traced = trace_clock(), phase = traced;
+  int nrects = 0;
+
+  if (PROBE_ENABLED(paint_all_entry) || PROBE_ENABLED(paint_all_return))
+    nrects = region_rect_count(dpy, region);
+  PROBE1(paint_all_entry, nrects);
   if (!region) {
     XRectangle r;
     r.x = 0;
     r.y = 0;
     r.width = root_width;
     r.height = root_height;
-    region = XFixesCreateRegion(dpy, &r, 1);
+    region = new_region(dpy, &r, 1);
   }
 #if MONITOR_REPAINT
   rootBuffer = rootPicture;
@@ -837,9 +2082,11 @@ static void paint_all(Display *dpy, XserverRegion region) {
   if (!rootBuffer) {
     Pixmap rootPixmap = XCreatePixmap(dpy, root, root_width, root_height,
                                       DefaultDepth(dpy, scr));
+    label_resource(rootPixmap, ResRoot, 0);
     rootBuffer = XRenderCreatePicture(
         dpy, rootPixmap, XRenderFindVisualFormat(dpy, DefaultVisual(dpy, scr)),
         0, NULL);
+    label_resource(rootBuffer, ResRoot, 0);
     XFreePixmap(dpy, rootPixmap);
   }
 #endif
@@ -869,8 +2116,13 @@ static void paint_all(Display *dpy, XserverRegion region) {
       Drawable draw = w->id;
 
 #if HAS_NAME_WINDOW_PIXMAP
-      if (hasNamePixmap && !w->pixmap)
+      if (hasNamePixmap && !w->pixmap) {
         w->pixmap = XCompositeNameWindowPixmap(dpy, w->id);
+        label_resource(w->pixmap, ResWindowPixmap,
+                       pixmap_bytes(w->a.width + w->a.border_width * 2,
+                                    w->a.height + w->a.border_width * 2,
+                                    w->a.depth));
+      }
       if (w->pixmap)
         draw = w->pixmap;
 #endif
@@ -878,6 +2130,7 @@ static void paint_all(Display *dpy, XserverRegion region) {
       pa.subwindow_mode = IncludeInferiors;
       w->picture =
           XRenderCreatePicture(dpy, draw, format, CPSubwindowMode, &pa);
+      label_resource(w->picture, ResWindowPicture, 0);
     }
 #if DEBUG_REPAINT
     printf(" 0x%x", w->id);
@@ -889,11 +2142,11 @@ static void paint_all(Display *dpy, XserverRegion region) {
         w->borderSize = None;
       }
       if (w->extents) {
-        XFixesDestroyRegion(dpy, w->extents);
+        free_region(dpy, w->extents);
         w->extents = None;
       }
       if (w->borderClip) {
-        XFixesDestroyRegion(dpy, w->borderClip);
+        free_region(dpy, w->borderClip);
         w->borderClip = None;
       }
     }
@@ -901,6 +2154,11 @@ static void paint_all(Display *dpy, XserverRegion region) {
       w->borderSize = border_size(dpy, w);
     if (!w->extents)
       w->extents = win_extents(dpy, w);
+    if (above && !above_overlay(w)) {
+      above = False;
+      overlayClip = copy_region(dpy, region);
+    }
+    w->above_overlay = above;
     if (w->mode == WINDOW_SOLID) {
       int x, y, wid, hei;
 #if HAS_NAME_WINDOW_PIXMAP
@@ -922,8 +2180,7 @@ static void paint_all(Display *dpy, XserverRegion region) {
                        x, y, wid, hei);
     }
     if (!w->borderClip) {
-      w->borderClip = XFixesCreateRegion(dpy, NULL, 0);
-      XFixesCopyRegion(dpy, w->borderClip, region);
+      w->borderClip = copy_region(dpy, region);
     }
     w->prev_trans = t;
     t = w;
@@ -932,9 +2189,29 @@ static void paint_all(Display *dpy, XserverRegion region) {
   printf("\n");
   fflush(stdout);
 #endif
+  if (above) {
+    overlayClip = copy_region(dpy, region);
+  }
+  phase = trace(TracePaintOpaque, phase, 0);
   XFixesSetPictureClipRegion(dpy, rootBuffer, 0, 0, region);
-  paint_root(dpy);
+  if (exclusionChanged)
+    rebuild_exclusion(dpy);
+  opaque = !n_overlay_exclude;
+  for (w = t; w && opaque; w = w->prev_trans)
+    if (w->mode != WINDOW_SOLID || compMode != CompSimple)
+      opaque = False;
+  if (paint_background(dpy, opaque)) {
+    /* the lines are already there wherever the root window is seen, and
+       only opaque windows were painted, so that is what is left of the
+       damage */
+    XFixesSubtractRegion(dpy, overlayClip, overlayClip, region);
+  }
+  phase = trace(TracePaintRoot, phase, 0);
   for (w = t; w; w = w->prev_trans) {
+    if (w->above_overlay && overlayClip) {
+      paint_overlay_clipped(dpy, overlayClip);
+      overlayClip = None;
+    }
     XFixesSetPictureClipRegion(dpy, rootBuffer, 0, 0, w->borderClip);
     switch (compMode) {
     case CompSimple:
@@ -1002,55 +2279,519 @@ static void paint_all(Display *dpy, XserverRegion region) {
       XRenderComposite(dpy, PictOpOver, w->picture, w->alphaPict, rootBuffer, 0,
                        0, 0, 0, x, y, wid, hei);
     }
-    XFixesDestroyRegion(dpy, w->borderClip);
+    free_region(dpy, w->borderClip);
     w->borderClip = None;
   }
-  XFixesDestroyRegion(dpy, region);
+  phase = trace(TracePaintTranslucent, phase, 0);
+  if (overlayClip)
+    paint_overlay_clipped(dpy, overlayClip);
+  phase = trace_clock();
   if (rootBuffer != rootPicture) {
     XFixesSetPictureClipRegion(dpy, rootBuffer, 0, 0, None);
-    XRenderComposite(dpy, PictOpOver, overlayPicture, None, rootBuffer, 0, 0, 0,
-                     0, 0, 0, root_width, root_height);
     XRenderComposite(dpy, PictOpSrc, rootBuffer, None, rootPicture, 0, 0, 0, 0,
                      0, 0, root_width, root_height);
   }
+  free_region(dpy, region);
+  trace(TracePaintCopy, phase, 0);
+  trace(TracePaint, traced, 0);
+  PROBE1(paint_all_return, nrects);
 }
 
 static void add_damage(Display *dpy, XserverRegion damage) {
   if (allDamage) {
     XFixesUnionRegion(dpy, allDamage, allDamage, damage);
-    XFixesDestroyRegion(dpy, damage);
+    free_region(dpy, damage);
   } else
     allDamage = damage;
 }
 
-static void repair_win(Display *dpy, win *w) {
-  XserverRegion parts;
+/* Upload the shadows the workers have finished. Results for windows that
+ * are gone or unmapped, or have since changed size or opacity, are dropped;
+ * an unmapped window asks for its shadow again when it is painted.
+ */
+static void collect_shadows(Display *dpy) {
+  shadow_job *job, *next;
+  char buf[64];
+
+  while (read(shadowPipe[0], buf, sizeof(buf)) > 0)
+    ;
+  pthread_mutex_lock(&shadowLock);
+  job = shadowResults;
+  shadowResults = NULL;
+  pthread_mutex_unlock(&shadowLock);
+
+  for (; job; job = next) {
+    win *w = find_win(dpy, job->id);
+    next = job->next;
+    if (w && w->shadow_pending && !w->shadow &&
+        w->shadow_for_width == job->width &&
+        w->shadow_for_height == job->height &&
+        w->shadow_for_opacity == job->opacity) {
+      w->shadow_pending = False;
+      if (w->a.map_state != IsViewable) {
+        free(job->data);
+        job->data = NULL;
+      }
+      if (job->data)
+        w->shadow = upload_shadow(dpy, job->data, job->swidth, job->sheight);
+      if (w->shadow) {
+        w->shadow_width = job->swidth;
+        w->shadow_height = job->sheight;
+        if (w->extents)
+          free_region(dpy, w->extents);
+        w->extents = win_extents(dpy, w);
+        add_damage(dpy, copy_region(dpy, w->extents));
+      }
+    } else
+      free(job->data);
+    free(job);
+  }
+}
+
+static void damage_overlay(Display *dpy) {
+  XRectangle r;
+
+  if (overlay_rect(&r))
+    add_damage(dpy, new_region(dpy, &r, 1));
+}
+
+/* Move the lines' opacity towards overlayTarget. Only a change of the
+ * quantized level needs a repaint, and then only of the area inside the
+ * margins.
+ */
+static void step_overlay_fade(Display *dpy, int steps) {
+  int level = overlay_alpha_level();
+
+  if (overlayOpacity < overlayTarget) {
+    overlayOpacity += overlayStep * steps;
+    if (overlayOpacity > overlayTarget)
+      overlayOpacity = overlayTarget;
+  } else {
+    overlayOpacity -= overlayStep * steps;
+    if (overlayOpacity < overlayTarget)
+      overlayOpacity = overlayTarget;
+  }
+  if (overlay_alpha_level() != level)
+    damage_overlay(dpy);
+}
+
+static void set_overlay_opacity(Display *dpy, double target) {
+  if (target == overlayTarget)
+    return;
+  if (!fades && overlayOpacity == overlayTarget)
+    fade_time = get_time_in_milliseconds() + fade_delta;
+  overlayTarget = target;
+  if (DIAGONATOR_FADE_TIME > fade_delta)
+    overlayStep = (double)fade_delta / DIAGONATOR_FADE_TIME;
+  else
+    overlayStep = 1;
+}
+
+static void set_overlay_level(Display *dpy, int level) {
+  if (level >= n_overlay_levels)
+    level = n_overlay_levels - 1;
+  if (level == overlayLevel)
+    return;
+  overlayLevel = level;
+  damage_overlay(dpy);
+}
+
+static void flush_configure(Display *dpy, win *w);
+
+static void add_damage_rect(XRectangle *r) {
+  if (n_damage_rects == size_damage_rects) {
+    size_damage_rects = size_damage_rects ? size_damage_rects * 2 : 64;
+    damageRects =
+        realloc(damageRects, size_damage_rects * sizeof(XRectangle));
+  }
+  damageRects[n_damage_rects++] = *r;
+}
+
+static unsigned long rect_area(const XRectangle *r) {
+  return (unsigned long)r->width * r->height;
+}
+
+static unsigned long rects_area(const XRectangle *r, int n) {
+  unsigned long area = 0;
+  int i;
+
+  for (i = 0; i < n; i++)
+    area += rect_area(&r[i]);
+  return area;
+}
+
+static void bounding_rect(XRectangle *dst, const XRectangle *a,
+                          const XRectangle *b) {
+  int x1 = min(a->x, b->x);
+  int y1 = min(a->y, b->y);
+  int x2 = max(a->x + a->width, b->x + b->width);
+  int y2 = max(a->y + a->height, b->y + b->height);
+
+  dst->x = x1;
+  dst->y = y1;
+  dst->width = x2 - x1;
+  dst->height = y2 - y1;
+}
+
+static int rect_gap(const XRectangle *a, const XRectangle *b) {
+  int dx = max(a->x, b->x) - min(a->x + a->width, b->x + b->width);
+  int dy = max(a->y, b->y) - min(a->y + a->height, b->y + b->height);
+
+  return max(dx, dy);
+}
+
+/* Merge rectangles closer than damageMergeDistance as long as the bounding
+ * box wastes at most damageMaxWaste of its area, then fall back to a single
+ * bounding box if more than damageMaxRects remain. Returns the new count.
+ */
+static int simplify_rects(XRectangle *r, int n) {
+  int i, j;
+
+  if (!damageMaxRects || n <= 1)
+    return n;
+  /* merging is quadratic, so very fragmented damage skips straight to the
+   * bounding box */
+  if (n <= damageMaxRects * 4) {
+    for (i = 0; i < n; i++) {
+      for (j = i + 1; j < n; j++) {
+        XRectangle box;
+        if (rect_gap(&r[i], &r[j]) > damageMergeDistance)
+          continue;
+        bounding_rect(&box, &r[i], &r[j]);
+        if (rect_area(&r[i]) + rect_area(&r[j]) <
+            (1 - damageMaxWaste) * rect_area(&box))
+          continue;
+        r[i] = box;
+        r[j] = r[--n];
+        j = i;
+      }
+    }
+  }
+  if (n > damageMaxRects) {
+    for (i = 1; i < n; i++)
+      bounding_rect(&r[0], &r[0], &r[i]);
+    n = 1;
+  }
+  return n;
+}
+
+/* Replace the damage of this frame with the bounding boxes of its parts in
+ * each DAMAGE_TILE_SIZE square of the screen.
+ */
+static void tile_damage_rects(void) {
+  int cols = (root_width + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+  int rows = (root_height + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+  XRectangle *tiles = calloc(cols * rows, sizeof(XRectangle));
+  int i, n = 0;
+
+  if (!tiles)
+    return;
+  for (i = 0; i < n_damage_rects; i++) {
+    XRectangle *r = &damageRects[i];
+    int x1 = max(r->x, 0), y1 = max(r->y, 0);
+    int x2 = min(r->x + r->width, root_width);
+    int y2 = min(r->y + r->height, root_height);
+    int tx, ty;
+
+    for (ty = y1 / DAMAGE_TILE_SIZE; y1 < y2 && ty * DAMAGE_TILE_SIZE < y2;
+         ty++) {
+      for (tx = x1 / DAMAGE_TILE_SIZE; x1 < x2 && tx * DAMAGE_TILE_SIZE < x2;
+           tx++) {
+        XRectangle part, *tile = &tiles[ty * cols + tx];
+        part.x = max(x1, tx * DAMAGE_TILE_SIZE);
+        part.y = max(y1, ty * DAMAGE_TILE_SIZE);
+        part.width = min(x2, (tx + 1) * DAMAGE_TILE_SIZE) - part.x;
+        part.height = min(y2, (ty + 1) * DAMAGE_TILE_SIZE) - part.y;
+        if (tile->width)
+          bounding_rect(tile, tile, &part);
+        else
+          *tile = part;
+      }
+    }
+  }
+  for (i = 0; i < cols * rows; i++)
+    if (tiles[i].width)
+      damageRects[n++] = tiles[i];
+  n_damage_rects = n;
+  free(tiles);
+}
+
+/* Whether the server's damage of w only needs to be reset, because the
+ * window is damaged as a whole or its delta rectangles are already here */
+static Bool damage_known(win *w) {
+  return !w->damaged || damageLevel == XDamageReportDeltaRectangles;
+}
 
+/* Add the damage w collected since the last frame. When damage_known, the
+ * server's damage was already reset by flush_damage; otherwise it is
+ * subtracted into *parts and merged into allDamage.
+ */
+static void repair_win(Display *dpy, win *w, XserverRegion *parts) {
+  w->damage_pending = False;
   if (!w->damaged) {
-    parts = win_extents(dpy, w);
-    set_ignore(dpy, NextRequest(dpy));
-    XDamageSubtract(dpy, w->damage, None, None);
+    flush_configure(dpy, w);
+    add_damage(dpy, win_extents(dpy, w));
+  } else if (damageLevel == XDamageReportDeltaRectangles) {
+    int i, n = w->n_damage_rects;
+    frameStats.damage_rects_in += n;
+    frameStats.damage_overdraw -= rects_area(w->damage_rects, n);
+    n = simplify_rects(w->damage_rects, n);
+    frameStats.damage_overdraw += rects_area(w->damage_rects, n);
+    for (i = 0; i < n; i++) {
+      XRectangle r = w->damage_rects[i];
+      r.x += w->a.x + w->a.border_width;
+      r.y += w->a.y + w->a.border_width;
+      add_damage_rect(&r);
+      if (compMode == CompServerShadows) {
+        r.x += w->shadow_dx;
+        r.y += w->shadow_dy;
+        add_damage_rect(&r);
+      }
+    }
   } else {
-    XserverRegion o;
-    parts = XFixesCreateRegion(dpy, NULL, 0);
+    if (!*parts)
+      *parts = new_region(dpy, NULL, 0);
+    if (!allDamage)
+      allDamage = new_region(dpy, NULL, 0);
     set_ignore(dpy, NextRequest(dpy));
-    XDamageSubtract(dpy, w->damage, None, parts);
-    XFixesTranslateRegion(dpy, parts, w->a.x + w->a.border_width,
+    XDamageSubtract(dpy, w->damage, None, *parts);
+    XFixesTranslateRegion(dpy, *parts, w->a.x + w->a.border_width,
                           w->a.y + w->a.border_width);
+    XFixesUnionRegion(dpy, allDamage, allDamage, *parts);
     if (compMode == CompServerShadows) {
-      o = XFixesCreateRegion(dpy, NULL, 0);
-      XFixesCopyRegion(dpy, o, parts);
-      XFixesTranslateRegion(dpy, o, w->shadow_dx, w->shadow_dy);
-      XFixesUnionRegion(dpy, parts, parts, o);
-      XFixesDestroyRegion(dpy, o);
+      XFixesTranslateRegion(dpy, *parts, w->shadow_dx, w->shadow_dy);
+      XFixesUnionRegion(dpy, allDamage, allDamage, *parts);
     }
   }
-  add_damage(dpy, parts);
+  w->n_damage_rects = 0;
   w->damaged = 1;
 }
 
+/* Turn the damage events of this frame into at most one fetch per window,
+ * and a single region for all the delta rectangles.
+ */
+static void flush_damage(Display *dpy) {
+  unsigned long request = NextRequest(dpy);
+  XserverRegion parts = None;
+  win *w;
+
+  /* windows may be destroyed since their damage, so the errors of the
+     subtractions that only reset it are ignored as one range. Those that
+     fetch the damage are each followed by a use of the region they fill,
+     so repair_win ignores them one at a time. The range is only opened
+     by the first subtraction, so that it never covers another request. */
+  for (w = list; w; w = w->next)
+    if (w->damage_pending && damage_known(w)) {
+      begin_ignore(dpy);
+      XDamageSubtract(dpy, w->damage, None, None);
+    }
+  end_ignore(dpy);
+  for (w = list; w; w = w->next)
+    if (w->damage_pending)
+      repair_win(dpy, w, &parts);
+  if (parts)
+    free_region(dpy, parts);
+  if (n_damage_rects) {
+    if (damageMaxRects && n_damage_rects > damageMaxRects) {
+      unsigned long area = rects_area(damageRects, n_damage_rects);
+      tile_damage_rects();
+      frameStats.damage_overdraw +=
+          (long)rects_area(damageRects, n_damage_rects) - (long)area;
+    }
+    frameStats.damage_rects_out += n_damage_rects;
+    add_damage(dpy, new_region(dpy, damageRects, n_damage_rects));
+    n_damage_rects = 0;
+  }
+  damagePending = False;
+  frameStats.damage_requests += NextRequest(dpy) - request;
+}
+
 static unsigned int get_opacity_prop(Display *dpy, win *w, unsigned int def);
 
+static Atom determine_wintype(Display *dpy, Window w);
+
+static void sync_sequence(Display *dpy);
+
+/* Whether a WM_CLASS value, the instance name and the class name each
+ * ended by a null byte, names one of excludeClasses */
+static Bool class_listed(const char *value, int length) {
+  const char *res_class = memchr(value, '\0', length);
+  int name_length = res_class ? res_class - value : length;
+  int class_length = 0;
+  int c;
+
+  if (res_class) {
+    res_class++;
+    class_length = strnlen(res_class, value + length - res_class);
+  }
+  for (c = 0; c < n_exclude_classes; c++) {
+    int l = strlen(excludeClasses[c]);
+
+    if ((l == name_length && !memcmp(value, excludeClasses[c], l)) ||
+        (res_class && l == class_length &&
+         !memcmp(res_class, excludeClasses[c], l)))
+      return True;
+  }
+  return False;
+}
+
+/* Find the class on w or, as it is usually on the client window inside the
+ * window manager's frame, on the windows inside it, one level of the tree
+ * at a time like determine_wintype.
+ */
+static Bool class_excluded(Display *dpy, Window w) {
+  xcb_window_t *level = malloc(sizeof(xcb_window_t));
+  int n = 1, i;
+  Bool excluded = False;
+  uint64_t traced;
+
+  if (!level)
+    return False;
+  level[0] = w;
+  while (n && !excluded) {
+    xcb_get_property_cookie_t *props = malloc(n * sizeof(*props));
+    xcb_query_tree_cookie_t *trees = malloc(n * sizeof(*trees));
+    xcb_window_t *next = NULL;
+    int n_next = 0;
+
+    if (!props || !trees) {
+      free(props);
+      free(trees);
+      break;
+    }
+    for (i = 0; i < n; i++) {
+      props[i] = xcb_get_property(xcb, 0, level[i], XCB_ATOM_WM_CLASS,
+                                  XCB_ATOM_STRING, 0, 256);
+      trees[i] = xcb_query_tree(xcb, level[i]);
+    }
+    traced = round_trip();
+    for (i = 0; i < n; i++) {
+      xcb_get_property_reply_t *prop =
+          xcb_get_property_reply(xcb, props[i], NULL);
+      xcb_query_tree_reply_t *tree;
+      Bool found = prop && xcb_get_property_value_length(prop) > 0;
+      int c;
+
+      if (found && !excluded)
+        excluded = class_listed(xcb_get_property_value(prop),
+                                xcb_get_property_value_length(prop));
+      free(prop);
+      /* only windows without a class are searched further */
+      if (found || excluded) {
+        xcb_discard_reply(xcb, trees[i].sequence);
+        continue;
+      }
+      tree = xcb_query_tree_reply(xcb, trees[i], NULL);
+      if (!tree)
+        continue;
+      c = xcb_query_tree_children_length(tree);
+      if (c) {
+        xcb_window_t *grown =
+            realloc(next, (n_next + c) * sizeof(xcb_window_t));
+        if (grown) {
+          next = grown;
+          memcpy(next + n_next, xcb_query_tree_children(tree),
+                 c * sizeof(xcb_window_t));
+          n_next += c;
+        }
+      }
+      free(tree);
+    }
+    trace(TraceRoundTrip, traced, n);
+    free(props);
+    free(trees);
+    free(level);
+    level = next;
+    n = n_next;
+  }
+  free(level);
+  sync_sequence(dpy);
+  return excluded;
+}
+
+static Bool win_excluded(Display *dpy, win *w) {
+  int t;
+
+  if (n_exclude_types) {
+    Atom type = determine_wintype(dpy, w->id);
+    for (t = 0; t < n_exclude_types; t++)
+      if (type == excludeTypes[t])
+        return True;
+  }
+  return n_exclude_classes && class_excluded(dpy, w->id);
+}
+
+/* Note that overlayExclude must be rebuilt after w was mapped, moved,
+ * restacked or unmapped: when w itself is excluded, and otherwise when some
+ * excluded window is mapped, as w may cover or uncover part of it.
+ */
+static void update_exclusion(Display *dpy, win *w) {
+  Bool in_exclude = w->excluded && w->a.map_state == IsViewable;
+  XRectangle r;
+
+  r.x = w->a.x;
+  r.y = w->a.y;
+  r.width = w->a.width + w->a.border_width * 2;
+  r.height = w->a.height + w->a.border_width * 2;
+  if (in_exclude != w->in_exclude ||
+      (in_exclude &&
+       (r.x != w->exclude_rect.x || r.y != w->exclude_rect.y ||
+        r.width != w->exclude_rect.width ||
+        r.height != w->exclude_rect.height)) ||
+      n_overlay_exclude)
+    exclusionChanged = True;
+  w->in_exclude = in_exclude;
+  w->exclude_rect = r;
+}
+
+/* Set overlayExclude to the parts of the mapped excluded windows that are
+ * not covered by windows stacked above them, as the lines are still drawn
+ * over those. Only called once a frame, when something changed.
+ */
+static void rebuild_exclusion(Display *dpy) {
+  XRectangle *above;
+  int n_above = 0, n = 0;
+  XserverRegion part, covered;
+  win *e;
+
+  exclusionChanged = False;
+  for (e = list; e; e = e->next)
+    n_above++;
+  above = malloc((n_above ? n_above : 1) * sizeof(XRectangle));
+  if (!above)
+    return;
+  n_above = 0;
+  if (overlayExclude)
+    XFixesSetRegion(dpy, overlayExclude, NULL, 0);
+  else
+    overlayExclude = new_region(dpy, NULL, 0);
+  /* the same two regions are refilled for every excluded window */
+  part = new_region(dpy, NULL, 0);
+  covered = new_region(dpy, NULL, 0);
+  for (e = list; e; e = e->next) {
+    if (e->in_exclude) {
+      XFixesSetRegion(dpy, part, &e->exclude_rect, 1);
+      if (n_above) {
+        XFixesSetRegion(dpy, covered, above, n_above);
+        XFixesSubtractRegion(dpy, part, part, covered);
+      }
+      XFixesUnionRegion(dpy, overlayExclude, overlayExclude, part);
+      n++;
+    }
+    if (e->a.map_state == IsViewable && e->a.class != InputOnly) {
+      above[n_above].x = e->a.x;
+      above[n_above].y = e->a.y;
+      above[n_above].width = e->a.width + e->a.border_width * 2;
+      above[n_above].height = e->a.height + e->a.border_width * 2;
+      n_above++;
+    }
+  }
+  free_region(dpy, part);
+  free_region(dpy, covered);
+  n_overlay_exclude = n;
+  free(above);
+}
+
 static void map_win(Display *dpy, Window id, unsigned long sequence,
                     Bool fade) {
   win *w = find_win(dpy, id);
@@ -1067,6 +2808,12 @@ static void map_win(Display *dpy, Window id, unsigned long sequence,
   w->opacity = get_opacity_prop(dpy, w, OPAQUE);
   determine_mode(dpy, w);
 
+  /* the type and class are usually only set just before mapping */
+  if (n_exclude_types || n_exclude_classes) {
+    w->excluded = win_excluded(dpy, w);
+    update_exclusion(dpy, w);
+  }
+
 #if CAN_DO_USABLE
   w->damage_bounds.x = w->damage_bounds.y = 0;
   w->damage_bounds.width = w->damage_bounds.height = 0;
@@ -1079,10 +2826,14 @@ static void map_win(Display *dpy, Window id, unsigned long sequence,
 }
 
 static void finish_unmap_win(Display *dpy, win *w) {
+  flush_configure(dpy, w);
   w->damaged = 0;
+  w->damage_pending = False;
+  w->n_damage_rects = 0;
 #if CAN_DO_USABLE
   w->usable = False;
 #endif
+  update_exclusion(dpy, w);
   if (w->extents != None) {
     add_damage(dpy, w->extents); /* destroys region */
     w->extents = None;
@@ -1110,12 +2861,9 @@ static void finish_unmap_win(Display *dpy, win *w) {
     XFixesDestroyRegion(dpy, w->borderSize);
     w->borderSize = None;
   }
-  if (w->shadow) {
-    XRenderFreePicture(dpy, w->shadow);
-    w->shadow = None;
-  }
+  release_shadow(dpy, w);
   if (w->borderClip) {
-    XFixesDestroyRegion(dpy, w->borderClip);
+    free_region(dpy, w->borderClip);
     w->borderClip = None;
   }
 
@@ -1152,9 +2900,13 @@ static unsigned int get_opacity_prop(Display *dpy, win *w, unsigned int def) {
   unsigned long n, left;
 
   unsigned char *data;
-  int result =
+  int result;
+  uint64_t traced = round_trip();
+
+  result =
       XGetWindowProperty(dpy, w->id, opacityAtom, 0L, 1L, False, XA_CARDINAL,
                          &actual, &format, &n, &left, &data);
+  trace(TraceRoundTrip, traced, 0);
   if (result == Success && data != NULL) {
     unsigned int i;
     memcpy(&i, data, sizeof(unsigned int));
@@ -1164,38 +2916,72 @@ static unsigned int get_opacity_prop(Display *dpy, win *w, unsigned int def) {
   return def;
 }
 
-/* Get the opacity property from the window in a percent format
-   not found: default
-   otherwise: the value
+/* Get the opacity of the lines from the root window property
+   not found: fully opaque
+   otherwise: the value, from 0 to 1
 */
-static double get_opacity_percent(Display *dpy, win *w, double def) {
-  unsigned int opacity = get_opacity_prop(dpy, w, (unsigned int)(OPAQUE * def));
+static double get_overlay_opacity(Display *dpy) {
+  Atom actual;
+  int format;
+  unsigned long n, left;
 
-  return opacity * 1.0 / OPAQUE;
+  unsigned char *data;
+  int result;
+  uint64_t traced = round_trip();
+
+  result =
+      XGetWindowProperty(dpy, root, overlayOpacityAtom, 0L, 1L, False,
+                         XA_CARDINAL, &actual, &format, &n, &left, &data);
+  trace(TraceRoundTrip, traced, 0);
+  if (result == Success && data != NULL) {
+    unsigned int i;
+    memcpy(&i, data, sizeof(unsigned int));
+    XFree((void *)data);
+    return i * 1.0 / OPAQUE;
+  }
+  return 1.0;
 }
 
-/* determine mode for window all in one place.
-   Future might check for menu flag and other cool things
+/* Get the density level of the lines from the root window property
+   not found: 0
+   otherwise: the value
 */
-
-static Atom get_wintype_prop(Display *dpy, Window w) {
+static int get_overlay_level(Display *dpy) {
   Atom actual;
   int format;
   unsigned long n, left;
 
   unsigned char *data;
-  int result = XGetWindowProperty(dpy, w, winTypeAtom, 0L, 1L, False, XA_ATOM,
-                                  &actual, &format, &n, &left, &data);
+  int result;
+  uint64_t traced = round_trip();
 
-  if (result == Success && data != (unsigned char *)None) {
-    Atom a;
-    memcpy(&a, data, sizeof(Atom));
+  result =
+      XGetWindowProperty(dpy, root, overlayLevelAtom, 0L, 1L, False,
+                         XA_CARDINAL, &actual, &format, &n, &left, &data);
+  trace(TraceRoundTrip, traced, 0);
+  if (result == Success && data != NULL) {
+    unsigned int i;
+    memcpy(&i, data, sizeof(unsigned int));
     XFree((void *)data);
-    return a;
+    return i < (unsigned int)n_overlay_levels ? (int)i : n_overlay_levels - 1;
   }
-  return winNormalAtom;
+  return 0;
 }
 
+/* Get the opacity property from the window in a percent format
+   not found: default
+   otherwise: the value
+*/
+static double get_opacity_percent(Display *dpy, win *w, double def) {
+  unsigned int opacity = get_opacity_prop(dpy, w, (unsigned int)(OPAQUE * def));
+
+  return opacity * 1.0 / OPAQUE;
+}
+
+/* determine mode for window all in one place.
+   Future might check for menu flag and other cool things
+*/
+
 static void determine_mode(Display *dpy, win *w) {
   int mode;
   XRenderPictFormat *format;
@@ -1225,50 +3011,171 @@ static void determine_mode(Display *dpy, win *w) {
     mode = WINDOW_SOLID;
   }
   w->mode = mode;
-  if (w->extents) {
-    XserverRegion damage;
-    damage = XFixesCreateRegion(dpy, NULL, 0);
-    XFixesCopyRegion(dpy, damage, w->extents);
-    add_damage(dpy, damage);
-  }
+  if (w->extents)
+    add_damage(dpy, copy_region(dpy, w->extents));
 }
 
+/* Xlib only catches up with the sequence numbers used by requests sent
+ * through xcb when it sends its own next request, so send one before
+ * NextRequest is trusted again.
+ */
+static void sync_sequence(Display *dpy) { XNoOp(dpy); }
+
+/* Find the window type on w or the windows inside it, one level of the tree
+ * at a time, with the requests for a whole level in flight at once.
+ */
 static Atom determine_wintype(Display *dpy, Window w) {
-  Window root_return, parent_return;
-  Window *children = NULL;
-  unsigned int nchildren, i;
-  Atom type;
-
-  type = get_wintype_prop(dpy, w);
-  if (type != winNormalAtom)
-    return type;
-
-  if (!XQueryTree(dpy, w, &root_return, &parent_return, &children,
-                  &nchildren)) {
-    /* XQueryTree failed. */
-    if (children)
-      XFree((void *)children);
+  xcb_window_t *level = malloc(sizeof(xcb_window_t));
+  int n = 1, i;
+  Atom type = winNormalAtom;
+  uint64_t traced;
+
+  if (!level)
     return winNormalAtom;
+  level[0] = w;
+  while (n && type == winNormalAtom) {
+    xcb_get_property_cookie_t *props = malloc(n * sizeof(*props));
+    xcb_query_tree_cookie_t *trees = malloc(n * sizeof(*trees));
+    xcb_window_t *next = NULL;
+    int n_next = 0;
+
+    if (!props || !trees) {
+      free(props);
+      free(trees);
+      break;
+    }
+    for (i = 0; i < n; i++) {
+      props[i] = xcb_get_property(xcb, 0, level[i], winTypeAtom, XCB_ATOM_ATOM,
+                                  0, 1);
+      trees[i] = xcb_query_tree(xcb, level[i]);
+    }
+    traced = round_trip();
+    for (i = 0; i < n; i++) {
+      xcb_get_property_reply_t *prop =
+          xcb_get_property_reply(xcb, props[i], NULL);
+      if (prop && type == winNormalAtom &&
+          xcb_get_property_value_length(prop) >= 4)
+        type = *(xcb_atom_t *)xcb_get_property_value(prop);
+      free(prop);
+    }
+    trace(TraceRoundTrip, traced, n);
+    for (i = 0; i < n; i++) {
+      xcb_query_tree_reply_t *tree;
+      int c;
+
+      if (type != winNormalAtom) {
+        xcb_discard_reply(xcb, trees[i].sequence);
+        continue;
+      }
+      tree = xcb_query_tree_reply(xcb, trees[i], NULL);
+      if (!tree)
+        continue;
+      c = xcb_query_tree_children_length(tree);
+      if (c) {
+        xcb_window_t *grown =
+            realloc(next, (n_next + c) * sizeof(xcb_window_t));
+        if (grown) {
+          next = grown;
+          memcpy(next + n_next, xcb_query_tree_children(tree),
+                 c * sizeof(xcb_window_t));
+          n_next += c;
+        }
+      }
+      free(tree);
+    }
+    free(props);
+    free(trees);
+    free(level);
+    level = next;
+    n = n_next;
   }
+  free(level);
+  sync_sequence(dpy);
+  return type;
+}
 
-  for (i = 0; i < nchildren; i++) {
-    type = determine_wintype(dpy, children[i]);
-    if (type != winNormalAtom)
-      return type;
-  }
+typedef struct _win_cookies {
+  xcb_get_window_attributes_cookie_t attributes;
+  xcb_get_geometry_cookie_t geometry;
+} win_cookies;
 
-  if (children)
-    XFree((void *)children);
+static void request_win(Window id, win_cookies *c) {
+  c->attributes = xcb_get_window_attributes(xcb, id);
+  c->geometry = xcb_get_geometry(xcb, id);
+}
+
+static Visual *find_visual(Display *dpy, VisualID id) {
+  int s, d, v;
 
-  return winNormalAtom;
+  for (s = 0; s < ScreenCount(dpy); s++) {
+    Screen *screen = ScreenOfDisplay(dpy, s);
+    for (d = 0; d < screen->ndepths; d++)
+      for (v = 0; v < screen->depths[d].nvisuals; v++)
+        if (screen->depths[d].visuals[v].visualid == id)
+          return &screen->depths[d].visuals[v];
+  }
+  return NULL;
 }
 
-static void add_win(Display *dpy, Window id, Window prev) {
+/* Fill in a from the replies to request_win, like XGetWindowAttributes.
+ * Errors come back in place of the replies, so they need no set_ignore.
+ */
+static Bool get_win_attributes(Display *dpy, win_cookies *c,
+                               XWindowAttributes *a) {
+  xcb_get_window_attributes_reply_t *attr =
+      xcb_get_window_attributes_reply(xcb, c->attributes, NULL);
+  xcb_get_geometry_reply_t *geom =
+      xcb_get_geometry_reply(xcb, c->geometry, NULL);
+  Bool ok = attr && geom;
+  int s;
+
+  if (ok) {
+    a->x = geom->x;
+    a->y = geom->y;
+    a->width = geom->width;
+    a->height = geom->height;
+    a->border_width = geom->border_width;
+    a->depth = geom->depth;
+    a->root = geom->root;
+    a->visual = find_visual(dpy, attr->visual);
+    a->class = attr->_class;
+    a->bit_gravity = attr->bit_gravity;
+    a->win_gravity = attr->win_gravity;
+    a->backing_store = attr->backing_store;
+    a->backing_planes = attr->backing_planes;
+    a->backing_pixel = attr->backing_pixel;
+    a->save_under = attr->save_under;
+    a->colormap = attr->colormap;
+    a->map_installed = attr->map_is_installed;
+    a->map_state = attr->map_state;
+    a->all_event_masks = attr->all_event_masks;
+    a->your_event_mask = attr->your_event_mask;
+    a->do_not_propagate_mask = attr->do_not_propagate_mask;
+    a->override_redirect = attr->override_redirect;
+    a->screen = NULL;
+    for (s = 0; s < ScreenCount(dpy); s++)
+      if (RootWindow(dpy, s) == a->root)
+        a->screen = ScreenOfDisplay(dpy, s);
+  }
+  free(attr);
+  free(geom);
+  return ok;
+}
+
+/* Add the window whose attributes were requested with request_win. The
+ * caller has already sent sync_sequence after the requests, as NextRequest
+ * is used for the damage sequence. */
+static void add_requested_win(Display *dpy, Window id, Window prev,
+                              win_cookies *c) {
   win *new = malloc(sizeof(win));
   win **p;
 
-  if (!new)
+  PROBE1(add_win, id);
+  if (!new) {
+    xcb_discard_reply(xcb, c->attributes.sequence);
+    xcb_discard_reply(xcb, c->geometry.sequence);
     return;
+  }
   if (prev) {
     for (p = &list; *p; p = &(*p)->next)
       if ((*p)->id == prev)
@@ -1276,16 +3183,10 @@ static void add_win(Display *dpy, Window id, Window prev) {
   } else
     p = &list;
   new->id = id;
-  set_ignore(dpy, NextRequest(dpy));
-  if (!XGetWindowAttributes(dpy, id, &new->a)) {
+  if (!get_win_attributes(dpy, c, &new->a)) {
     free(new);
     return;
   }
-  new->shaped = False;
-  new->shape_bounds.x = new->a.x;
-  new->shape_bounds.y = new->a.y;
-  new->shape_bounds.width = new->a.width;
-  new->shape_bounds.height = new->a.height;
   new->damaged = 0;
 #if CAN_DO_USABLE
   new->usable = False;
@@ -1299,7 +3200,7 @@ static void add_win(Display *dpy, Window id, Window prev) {
     new->damage = None;
   } else {
     new->damage_sequence = NextRequest(dpy);
-    new->damage = XDamageCreate(dpy, id, XDamageReportNonEmpty);
+    new->damage = XDamageCreate(dpy, id, damageLevel);
     XShapeSelectInput(dpy, id, ShapeNotifyMask);
   }
   new->alphaPict = None;
@@ -1307,6 +3208,7 @@ static void add_win(Display *dpy, Window id, Window prev) {
   new->borderSize = None;
   new->extents = None;
   new->shadow = None;
+  new->shadow_pending = False;
   new->shadow_dx = 0;
   new->shadow_dy = 0;
   new->shadow_width = 0;
@@ -1315,6 +3217,18 @@ static void add_win(Display *dpy, Window id, Window prev) {
 
   new->borderClip = None;
   new->prev_trans = NULL;
+  new->excluded = False;
+  new->in_exclude = False;
+  new->above_overlay = False;
+  new->configure_pending = False;
+  new->size_changed = False;
+  new->configure_damage = None;
+  new->damage_pending = False;
+  new->damage_rects = NULL;
+  new->n_damage_rects = 0;
+  new->size_damage_rects = 0;
+  new->damage_time = 0;
+  new->draw_time = 0;
 
   new->windowType = determine_wintype(dpy, new->id);
 
@@ -1324,9 +3238,45 @@ static void add_win(Display *dpy, Window id, Window prev) {
     map_win(dpy, id, new->damage_sequence - 1, True);
 }
 
+static void add_win(Display *dpy, Window id, Window prev) {
+  win_cookies c;
+  uint64_t traced = trace_clock();
+
+  request_win(id, &c);
+  sync_sequence(dpy);
+  frameStats.round_trips++;
+  add_requested_win(dpy, id, prev, &c);
+  trace(TraceAddWin, traced, 1);
+}
+
+/* Add all the windows at once, with their attribute requests pipelined */
+static void add_wins(Display *dpy, Window *ids, unsigned int n) {
+  win_cookies *c = malloc(n * sizeof(win_cookies));
+  unsigned int i;
+  uint64_t traced = trace_clock();
+
+  if (!c) {
+    for (i = 0; i < n; i++)
+      add_win(dpy, ids[i], i ? ids[i - 1] : None);
+    return;
+  }
+  for (i = 0; i < n; i++)
+    request_win(ids[i], &c[i]);
+  /* once for the whole batch; every later xcb request syncs on its own */
+  sync_sequence(dpy);
+  frameStats.round_trips++;
+  for (i = 0; i < n; i++)
+    add_requested_win(dpy, ids[i], i ? ids[i - 1] : None, &c[i]);
+  free(c);
+  trace(TraceAddWin, traced, n);
+}
+
 static void restack_win(Display *dpy, win *w, Window new_above) {
   Window old_above;
 
+  if (n_overlay_exclude)
+    exclusionChanged = True;
+
   if (w->next)
     old_above = w->next->id;
   else
@@ -1345,71 +3295,101 @@ static void restack_win(Display *dpy, win *w, Window new_above) {
       if ((*prev)->id == new_above)
         break;
     }
-    w->next = *prev;
-    *prev = w;
+    w->next = *prev;
+    *prev = w;
+  }
+}
+
+/* Apply the work that configure_win put off: the window's pixmap and shadow
+ * are dropped if its size changed since the last frame, and the area it
+ * covered then is damaged together with the area it covers now.
+ */
+static void flush_configure(Display *dpy, win *w) {
+  if (!w->configure_pending)
+    return;
+  w->configure_pending = False;
+  if (w->size_changed) {
+    w->size_changed = False;
+#if HAS_NAME_WINDOW_PIXMAP
+    if (w->pixmap) {
+      XFreePixmap(dpy, w->pixmap);
+      w->pixmap = None;
+      if (w->picture) {
+        XRenderFreePicture(dpy, w->picture);
+        w->picture = None;
+      }
+    }
+#endif
+    /* the shadow of a size the window no longer has is rarely wanted
+       again, and would only push useful ones out of the cache */
+    free_shadow(dpy, w);
+  }
+  update_exclusion(dpy, w);
+  if (w->configure_damage) {
+    XserverRegion extents = win_extents(dpy, w);
+    XFixesUnionRegion(dpy, w->configure_damage, w->configure_damage, extents);
+    free_region(dpy, extents);
+    add_damage(dpy, w->configure_damage);
+    w->configure_damage = None;
   }
 }
 
+static void flush_configures(Display *dpy) {
+  win *w;
+
+  for (w = list; w; w = w->next)
+    flush_configure(dpy, w);
+  configurePending = False;
+}
+
+/* An interactive move or resize sends hundreds of ConfigureNotify events a
+ * second. Only the geometry and stacking are updated here; everything else
+ * waits for flush_configure, which runs once before the next frame.
+ */
 static void configure_win(Display *dpy, XConfigureEvent *ce) {
   win *w = find_win(dpy, ce->window);
-  XserverRegion damage = None;
 
+  PROBE5(configure_win, ce->window, ce->x, ce->y, ce->width, ce->height);
   if (!w) {
     if (ce->window == root) {
       if (rootBuffer) {
         XRenderFreePicture(dpy, rootBuffer);
         rootBuffer = None;
       }
+      free_overlay_levels(dpy);
+      free_background(dpy);
       root_width = ce->width;
       root_height = ce->height;
     }
     return;
   }
+  frameStats.configure_events++;
+  if (!w->configure_pending) {
+    w->configure_pending = True;
 #if CAN_DO_USABLE
-  if (w->usable)
+    if (w->usable)
 #endif
-  {
-    damage = XFixesCreateRegion(dpy, NULL, 0);
-    if (w->extents != None)
-      XFixesCopyRegion(dpy, damage, w->extents);
+    {
+      if (w->extents != None)
+        w->configure_damage = copy_region(dpy, w->extents);
+      else
+        w->configure_damage = new_region(dpy, NULL, 0);
+    }
+    configurePending = True;
+    frameStats.configures_flushed++;
   }
-  w->shape_bounds.x -= w->a.x;
-  w->shape_bounds.y -= w->a.y;
+  /* the server may have named a pixmap of any size the window had since the
+     last frame, so even a size that is changed back counts */
+  if (ce->width != w->a.width || ce->height != w->a.height ||
+      ce->border_width != w->a.border_width)
+    w->size_changed = True;
   w->a.x = ce->x;
   w->a.y = ce->y;
-  if (w->a.width != ce->width || w->a.height != ce->height) {
-#if HAS_NAME_WINDOW_PIXMAP
-    if (w->pixmap) {
-      XFreePixmap(dpy, w->pixmap);
-      w->pixmap = None;
-      if (w->picture) {
-        XRenderFreePicture(dpy, w->picture);
-        w->picture = None;
-      }
-    }
-#endif
-    if (w->shadow) {
-      XRenderFreePicture(dpy, w->shadow);
-      w->shadow = None;
-    }
-  }
   w->a.width = ce->width;
   w->a.height = ce->height;
   w->a.border_width = ce->border_width;
   w->a.override_redirect = ce->override_redirect;
   restack_win(dpy, w, ce->above);
-  if (damage) {
-    XserverRegion extents = win_extents(dpy, w);
-    XFixesUnionRegion(dpy, damage, damage, extents);
-    XFixesDestroyRegion(dpy, extents);
-    add_damage(dpy, damage);
-  }
-  w->shape_bounds.x += w->a.x;
-  w->shape_bounds.y += w->a.y;
-  if (!w->shaped) {
-    w->shape_bounds.width = w->a.width;
-    w->shape_bounds.height = w->a.height;
-  }
 
   clipChanged = True;
 }
@@ -1432,11 +3412,15 @@ static void circulate_win(Display *dpy, XCirculateEvent *ce) {
 static void finish_destroy_win(Display *dpy, Window id, Bool gone) {
   win **prev, *w;
 
+  PROBE2(finish_destroy_win, id, gone);
   for (prev = &list; (w = *prev); prev = &w->next)
     if (w->id == id) {
+      flush_configure(dpy, w);
       if (gone)
         finish_unmap_win(dpy, w);
       *prev = w->next;
+      w->excluded = False;
+      update_exclusion(dpy, w);
       if (w->picture) {
         set_ignore(dpy, NextRequest(dpy));
         XRenderFreePicture(dpy, w->picture);
@@ -1450,16 +3434,14 @@ static void finish_destroy_win(Display *dpy, Window id, Bool gone) {
         XRenderFreePicture(dpy, w->shadowPict);
         w->shadowPict = None;
       }
-      if (w->shadow) {
-        XRenderFreePicture(dpy, w->shadow);
-        w->shadow = None;
-      }
+      release_shadow(dpy, w);
       if (w->damage != None) {
         set_ignore(dpy, NextRequest(dpy));
         XDamageDestroy(dpy, w->damage);
         w->damage = None;
       }
       cleanup_fade(dpy, w);
+      free(w->damage_rects);
       free(w);
       break;
     }
@@ -1507,6 +3489,8 @@ dump_wins (void)
 static void damage_win(Display *dpy, XDamageNotifyEvent *de) {
   win *w = find_win(dpy, de->drawable);
 
+  PROBE5(damage_win, de->drawable, de->area.x, de->area.y, de->area.width,
+         de->area.height);
   if (!w)
     return;
 #if CAN_DO_USABLE
@@ -1554,7 +3538,25 @@ static void damage_win(Display *dpy, XDamageNotifyEvent *de) {
   }
   if (w->usable)
 #endif
-    repair_win(dpy, w); // NOLINT(readability-misleading-indentation)
+  { // NOLINT(readability-misleading-indentation)
+    if (damageLevel == XDamageReportDeltaRectangles) {
+      if (w->n_damage_rects == w->size_damage_rects) {
+        w->size_damage_rects =
+            w->size_damage_rects ? w->size_damage_rects * 2 : 8;
+        w->damage_rects = realloc(w->damage_rects,
+                                  w->size_damage_rects * sizeof(XRectangle));
+      }
+      w->damage_rects[w->n_damage_rects++] = de->area;
+    }
+    w->damage_pending = True;
+    damagePending = True;
+    if (latencyProbe && !w->damage_time)
+      w->damage_time = wall_time();
+    frameStats.damage_events++;
+    pageStats.damage_events++;
+    pageStats.damage_rects++;
+    pageStats.damage_area += de->area.width * de->area.height;
+  }
 }
 
 #if DEBUG_SHAPE
@@ -1582,8 +3584,7 @@ static void shape_win(Display *dpy, XShapeEvent *se) {
     return;
 
   if (se->kind == ShapeClip || se->kind == ShapeBounding) {
-    XserverRegion region0;
-    XserverRegion region1;
+    XserverRegion damage;
 
 #if DEBUG_SHAPE
     printf("win 0x%lx %s:%s %ux%u+%d+%d\n", (unsigned long)se->window,
@@ -1591,30 +3592,84 @@ static void shape_win(Display *dpy, XShapeEvent *se) {
            se->width, se->height, se->x, se->y);
 #endif
 
-    clipChanged = True;
-
-    region0 = XFixesCreateRegion(dpy, &w->shape_bounds, 1);
+    if (w->a.map_state != IsViewable) {
+      if (w->borderSize != None) {
+        begin_ignore(dpy);
+        XFixesDestroyRegion(dpy, w->borderSize);
+        end_ignore(dpy);
+        w->borderSize = None;
+      }
+      return;
+    }
 
-    if (se->shaped == True) {
-      w->shaped = True;
-      w->shape_bounds.x = w->a.x + se->x;
-      w->shape_bounds.y = w->a.y + se->y;
-      w->shape_bounds.width = se->width;
-      w->shape_bounds.height = se->height;
-    } else {
-      w->shaped = False;
-      w->shape_bounds.x = w->a.x;
-      w->shape_bounds.y = w->a.y;
-      w->shape_bounds.width = w->a.width;
-      w->shape_bounds.height = w->a.height;
+    /* repaint the old and the new shape, which also replaces the
+     * borderSize of this window. The old one is invalid if the window was
+     * already gone when it was made, so it is added to an emptied region
+     * rather than copied over one from the pool, which would keep the
+     * pooled region's last contents. */
+    if (w->borderSize != None) {
+      damage = new_region(dpy, NULL, 0);
+      begin_ignore(dpy);
+      XFixesUnionRegion(dpy, damage, damage, w->borderSize);
+      XFixesDestroyRegion(dpy, w->borderSize);
+      end_ignore(dpy);
+    } else
+      damage = win_extents(dpy, w);
+    w->borderSize = border_size(dpy, w);
+    set_ignore(dpy, NextRequest(dpy));
+    XFixesUnionRegion(dpy, damage, damage, w->borderSize);
+    if (compMode == CompServerShadows) {
+      XserverRegion shadow = copy_region(dpy, damage);
+      XFixesTranslateRegion(dpy, shadow, w->shadow_dx, w->shadow_dy);
+      XFixesUnionRegion(dpy, damage, damage, shadow);
+      free_region(dpy, shadow);
     }
+    add_damage(dpy, damage);
+  }
+}
+
+/* Keep the time the client stamped its next drawing into w with */
+static void stamp_win(Display *dpy, Window id) {
+  win *w = find_win(dpy, id);
+  Atom actual;
+  int format;
+  unsigned long n, left;
+  unsigned char *data;
+  uint64_t traced;
+  int result;
+
+  if (!w)
+    return;
+  traced = round_trip();
+  result = XGetWindowProperty(dpy, id, latencyAtom, 0L, 2L, False,
+                              XA_CARDINAL, &actual, &format, &n, &left, &data);
+  trace(TraceRoundTrip, traced, 0);
+  if (result != Success || !data)
+    return;
+  if (n == 2) {
+    unsigned long *v = (unsigned long *)data;
+    w->draw_time = ((uint64_t)v[0] << 32 | (uint32_t)v[1]) / 1e6;
+  }
+  XFree(data);
+}
 
-    region1 = XFixesCreateRegion(dpy, &w->shape_bounds, 1);
-    XFixesUnionRegion(dpy, region0, region0, region1);
-    XFixesDestroyRegion(dpy, region1);
+/* Take the latencies of the windows painted in the frame the server has just
+ * finished */
+static void count_latencies(void) {
+  double now = wall_time();
+  win *w;
 
-    /* ask for repaint of the old and new region */
-    paint_all(dpy, region0);
+  for (w = list; w; w = w->next) {
+    if (!w->damage_time)
+      continue;
+    if (w->a.map_state == IsViewable) {
+      add_sample(damageLatencies, &n_damage_latencies, now - w->damage_time);
+      if (w->draw_time) {
+        add_sample(drawLatencies, &n_draw_latencies, now - w->draw_time);
+        w->draw_time = 0;
+      }
+    }
+    w->damage_time = 0;
   }
 }
 
@@ -1683,9 +3738,149 @@ static int error(Display *dpy, XErrorEvent *ev) {
   return 0;
 }
 
+static void write_record(record *r) {
+  r->time = get_time_in_milliseconds() - record_start;
+  fwrite(r, sizeof(record), 1, recordFile);
+}
+
+static void record_window(win *w) {
+  record r;
+
+  if (!w)
+    return;
+  record_window(w->next);
+  memset(&r, 0, sizeof(r));
+  r.type = CreateNotify;
+  r.window = w->id;
+  r.x = w->a.x;
+  r.y = w->a.y;
+  r.width = w->a.width;
+  r.height = w->a.height;
+  r.border_width = w->a.border_width;
+  r.flag = w->a.override_redirect;
+  write_record(&r);
+  if (w->a.map_state == IsViewable) {
+    r.type = MapNotify;
+    write_record(&r);
+  }
+}
+
+/* Start the recording with the windows that already exist, as if they had
+ * just been created, bottom first.
+ */
+static void start_recording(const char *path) {
+  record_header h;
+
+  recordFile = fopen(path, "wb");
+  if (!recordFile) {
+    perror(path);
+    exit(1);
+  }
+  h.magic = RECORD_MAGIC;
+  h.version = RECORD_VERSION;
+  h.record_size = sizeof(record);
+  h.root_width = root_width;
+  h.root_height = root_height;
+  fwrite(&h, sizeof(h), 1, recordFile);
+  record_start = get_time_in_milliseconds();
+  record_window(list);
+  fflush(recordFile);
+}
+
+/* The opacity of w was set to opacity; recorded by the PropertyNotify
+ * handler, which reads the new value anyway */
+static void record_opacity(win *w, unsigned int opacity) {
+  record r;
+
+  memset(&r, 0, sizeof(r));
+  r.type = PropertyNotify;
+  r.window = w->id;
+  r.value = opacity;
+  write_record(&r);
+}
+
+static void record_event(Display *dpy, XEvent *ev) {
+  record r;
+
+  memset(&r, 0, sizeof(r));
+  r.type = ev->type;
+  switch (ev->type) {
+  case CreateNotify:
+    r.window = ev->xcreatewindow.window;
+    r.x = ev->xcreatewindow.x;
+    r.y = ev->xcreatewindow.y;
+    r.width = ev->xcreatewindow.width;
+    r.height = ev->xcreatewindow.height;
+    r.border_width = ev->xcreatewindow.border_width;
+    r.flag = ev->xcreatewindow.override_redirect;
+    break;
+  case ConfigureNotify:
+    r.window = ev->xconfigure.window;
+    r.sibling = ev->xconfigure.above;
+    r.x = ev->xconfigure.x;
+    r.y = ev->xconfigure.y;
+    r.width = ev->xconfigure.width;
+    r.height = ev->xconfigure.height;
+    r.border_width = ev->xconfigure.border_width;
+    r.flag = ev->xconfigure.override_redirect;
+    break;
+  case DestroyNotify:
+    r.window = ev->xdestroywindow.window;
+    break;
+  case MapNotify:
+    r.window = ev->xmap.window;
+    break;
+  case UnmapNotify:
+    r.window = ev->xunmap.window;
+    break;
+  case ReparentNotify:
+    r.window = ev->xreparent.window;
+    r.sibling = ev->xreparent.parent;
+    r.x = ev->xreparent.x;
+    r.y = ev->xreparent.y;
+    break;
+  case CirculateNotify:
+    r.window = ev->xcirculate.window;
+    r.flag = ev->xcirculate.place;
+    break;
+  case Expose:
+    if (ev->xexpose.window != root)
+      return;
+    r.window = root;
+    r.x = ev->xexpose.x;
+    r.y = ev->xexpose.y;
+    r.width = ev->xexpose.width;
+    r.height = ev->xexpose.height;
+    break;
+  default:
+    if (ev->type == damage_event + XDamageNotify) {
+      XDamageNotifyEvent *de = (XDamageNotifyEvent *)ev;
+      r.type = RecordDamage;
+      r.window = de->drawable;
+      r.x = de->area.x;
+      r.y = de->area.y;
+      r.width = de->area.width;
+      r.height = de->area.height;
+    } else if (ev->type == xshape_event + ShapeNotify) {
+      XShapeEvent *se = (XShapeEvent *)ev;
+      if (se->kind != ShapeBounding)
+        return;
+      r.type = RecordShape;
+      r.window = se->window;
+      r.flag = se->shaped;
+      r.x = se->x;
+      r.y = se->y;
+      r.width = se->width;
+      r.height = se->height;
+    } else
+      return;
+  }
+  write_record(&r);
+}
+
 static void expose_root(Display *dpy, Window root, XRectangle *rects,
                         int nrects) {
-  XserverRegion region = XFixesCreateRegion(dpy, rects, nrects);
+  XserverRegion region = new_region(dpy, rects, nrects);
 
   add_damage(dpy, region);
 }
@@ -1757,7 +3952,56 @@ static void usage(const char *program, int exit_code) {
       "      Spacing between the lines.\n"
       "   --line-style style\n"
       "      Style of the lines, as an integer. (0 = LineSolid, 1 = "
-      "LineOnOffDash, 2 = LineDoubleDash)\n\n"
+      "LineOnOffDash, 2 = LineDoubleDash)\n"
+      "   --line-color color\n"
+      "      Colour of the lines, as #AARRGGBB or #RRGGBB.\n"
+      "   --line-dashes dashes\n"
+      "      Dash lengths for the dashed styles, separated by colons "
+      "(e.g. 10:5).\n"
+      "   --layer spec\n"
+      "      Draw an additional layer of lines on top of the first one. spec "
+      "is a\n"
+      "      comma-separated list of key=value pairs with the keys direction, "
+      "width,\n"
+      "      spacing, style, color and dashes (e.g. "
+      "direction=150,color=#80ff0000).\n"
+      "      Keys that are left out are taken from the --line-* options. May "
+      "be given\n"
+      "      multiple times.\n"
+      "   --line-fade-time milliseconds\n"
+      "      Time the lines take to fade in or out when the "
+      "_DIAGONATOR_OPACITY\n"
+      "      property on the root window changes. (default 2000)\n"
+      "   --line-spacing-levels spacings\n"
+      "      Comma-separated list of spacings (e.g. 50,35,20) for the "
+      "density levels\n"
+      "      chosen by the _DIAGONATOR_LEVEL property on the root window. "
+      "Other\n"
+      "      layers are scaled along with the first one.\n"
+      "   --line-scroll-speed pixels-per-second\n"
+      "      Scroll the lines across the screen. Only patterns made of "
+      "solid lines\n"
+      "      scroll. (default 0)\n"
+      "   --line-scroll-fps frames-per-second\n"
+      "      Frame rate of the scrolling. (default 30)\n"
+      "   --exclude-class class\n"
+      "      Don't draw the lines over windows with this WM_CLASS name or "
+      "class. May\n"
+      "      be given multiple times.\n"
+      "   --exclude-type type\n"
+      "      Don't draw the lines over windows of this type, such as dock or "
+      "dialog.\n"
+      "      May be given multiple times.\n"
+      "   --lines-below type\n"
+      "      Draw the lines below windows of this type, such as dock, when "
+      "they are at\n"
+      "      the top of the stack. May be given multiple times.\n"
+      "   --cache-background\n"
+      "      Keep a copy of the wallpaper with the lines already drawn on it, "
+      "so that\n"
+      "      uncovered parts of the desktop are painted in one pass. Uses "
+      "memory for\n"
+      "      one more screen-sized picture.\n\n"
       "Configure the margins to make diagonator draw in a custom rectangular "
       "area instead of your entire screen:\n"
       "   --top-margin pixels\n"
@@ -1803,7 +4047,65 @@ static void usage(const char *program, int exit_code) {
       "   -s\n"
       "      Draw server-side shadows with sharp edges.\n"
       "   -S\n"
-      "      Enable synchronous operation (for debugging).\n");
+      "      Enable synchronous operation (for debugging).\n"
+      "   --shadow-cache megabytes\n"
+      "      Memory kept for the client-side shadows of unmapped and "
+      "destroyed windows,\n"
+      "      so they can be reused when a window of the same size is "
+      "mapped.\n"
+      "      (default 16)\n"
+      "   --damage-level nonempty|delta\n"
+      "      How windows report damage. nonempty fetches the damaged region "
+      "from the\n"
+      "      server once per frame; delta collects the damaged rectangles "
+      "from the\n"
+      "      events. (default nonempty)\n"
+      "   --damage-max-rects count\n"
+      "      Simplify the damage of each frame: merge nearby rectangles, "
+      "then use one\n"
+      "      bounding box per window or per screen tile when more than "
+      "count remain.\n"
+      "      Implies --damage-level delta, and cannot be used with "
+      "nonempty.\n"
+      "      (default 0, off)\n"
+      "   --damage-merge-distance pixels\n"
+      "      How far apart rectangles may be to be merged. (default 8)\n"
+      "   --damage-max-waste ratio\n"
+      "      How much of a merged rectangle may be undamaged, from 0 to 1. "
+      "(default 0.5)\n"
+      "   --record file\n"
+      "      Write every event handled to file, to be played back later "
+      "with\n"
+      "      bench/replay. Implies --damage-level delta, and cannot be "
+      "used with\n"
+      "      nonempty.\n"
+      "   --shadow-threads count\n"
+      "      Make client-side shadows on this many threads. Windows have no "
+      "shadow\n"
+      "      until theirs is ready. 0 makes them while painting. (default "
+      "0)\n"
+      "   --latency\n"
+      "      Add the latency from drawing to the screen to --stats, see "
+      "bench/latency.\n"
+      "      Waits for the server to finish each frame.\n"
+      "   --resources seconds\n"
+      "      Print the pixmaps, pictures, regions and damage objects held "
+      "in the server\n"
+      "      to stderr at this interval, checked against the X-Resource "
+      "extension.\n"
+      "   --stats seconds\n"
+      "      Print paint statistics to stderr at this interval.\n"
+      "   --stats-page file\n"
+      "      Keep live statistics in file, normally in /dev/shm, for "
+      "monitoring tools\n"
+      "      to read. See stats.h.\n"
+      "   --trace-file file\n"
+      "      Where SIGUSR2 makes diagonator write the recent trace events, "
+      "in the Chrome\n"
+      "      trace format. (default /tmp/diagonator-trace-PID.json)\n"
+      "   --trace-events count\n"
+      "      How many trace events to keep. 0 turns tracing off. (default "
+      "32768)\n");
   exit(exit_code);
 }
 
@@ -1850,67 +4152,393 @@ static Bool register_cm(Display *dpy) {
   return True;
 }
 
-void draw_diagonals(Display *dpy, Pixmap pixmap) {
-  int left = DIAGONATOR_LEFT_MARGIN;
-  int right = root_width - DIAGONATOR_RIGHT_MARGIN;
-  int top = DIAGONATOR_TOP_MARGIN;
-  int bottom = root_height - DIAGONATOR_BOTTOM_MARGIN;
-  int width = right - left;
-  int height = bottom - top;
-
-  unsigned long mask = 0;
-  XGCValues values;
-  values.foreground = 0;
-  mask |= GCForeground;
-  values.line_style = DIAGONATOR_LINE_STYLE;
-  mask |= GCLineStyle;
-  values.line_width = DIAGONATOR_LINE_WIDTH;
-  mask |= GCLineWidth;
-  GC gc = XCreateGC(dpy, pixmap, mask, &values);
-  XFillRectangle(dpy, pixmap, gc, 0, 0, root_width, root_height);
-  XSetForeground(dpy, gc, 1);
-  double theta = DIAGONATOR_LINE_DIRECTION * M_PI / 180.0;
-  double dist = sin(theta) * width + fabs(cos(theta)) * height;
-  int line_count = dist / DIAGONATOR_LINE_SPACING + 1;
+/* Draw one layer of lines into the width x height area at the origin of d. */
+void draw_diagonals(Display *dpy, Drawable d, GC gc, const line_layer *l,
+                    int width, int height) {
+  int line_count =
+      diagonal_segment_count(l->direction, l->spacing, width, height);
+  if (!line_count)
+    return;
   XSegment lines[line_count];
-  for (int i = 0; i < line_count; ++i) {
-    double x1, y1, x2, y2;
+  diagonal_segments(l->direction, l->spacing, width, height, lines);
+  XDrawSegments(dpy, d, gc, lines, line_count);
+}
 
-    double left_y;
-    if (theta < M_PI / 2) {
-      left_y = i * DIAGONATOR_LINE_SPACING / cos(theta);
-    } else {
-      left_y = height + i * DIAGONATOR_LINE_SPACING / cos(theta);
+/* Period of a layer's lines along each axis, rounded to whole pixels so that
+ * a tile of that size repeats seamlessly. A period of 0 means that the lines
+ * are (close enough to) parallel to that axis.
+ */
+static Bool layer_period(const line_layer *l, double spacing, int *px,
+                         int *py) {
+  double theta = l->direction * M_PI / 180.0;
+  double sx = fabs(sin(theta));
+  double sy = fabs(cos(theta));
+
+  *px = sx * MAX_TILE_SIZE > spacing ? (int)(spacing / sx + 0.5) : 0;
+  *py = sy * MAX_TILE_SIZE > spacing ? (int)(spacing / sy + 0.5) : 0;
+  return *px || *py;
+}
+
+static int lcm(int a, int b) {
+  int x = a, y = b;
+
+  while (y) {
+    int t = x % y;
+    x = y;
+    y = t;
+  }
+  return a / x * b;
+}
+
+/* Whether lines repeating every px across and py down stay within a pixel
+ * of the lines of l across extent pixels, despite the rounding */
+static Bool period_matches(const line_layer *l, double spacing, int px, int py,
+                           double extent) {
+  double theta = l->direction * M_PI / 180.0;
+  double angle = atan2(fabs(sin(theta)), fabs(cos(theta)));
+  double tile_angle, tile_spacing;
+
+  if (px && py) {
+    tile_angle = atan2(py, px);
+    tile_spacing = px * py / hypot(px, py);
+  } else if (px) {
+    tile_angle = M_PI / 2;
+    tile_spacing = px;
+  } else {
+    tile_angle = 0;
+    tile_spacing = py;
+  }
+  return extent * fabs(angle - tile_angle) +
+             extent / spacing * fabs(spacing - tile_spacing) <=
+         1;
+}
+
+/* Find a tile that every layer repeats across when its spacing is multiplied
+ * by scale. Dashed lines don't repeat along their length, so they are never
+ * tiled.
+ */
+static Bool overlay_tile_size(double scale, int *width, int *height) {
+  int area_width =
+      root_width - DIAGONATOR_LEFT_MARGIN - DIAGONATOR_RIGHT_MARGIN;
+  int area_height =
+      root_height - DIAGONATOR_TOP_MARGIN - DIAGONATOR_BOTTOM_MARGIN;
+  double extent = hypot(area_width, area_height);
+  int tw = 1, th = 1;
+  int i;
+
+  for (i = 0; i < n_layers; i++) {
+    double spacing = layers[i].spacing * scale;
+    int px, py;
+
+    if (layers[i].style != LineSolid || layers[i].spacing <= 0 ||
+        !layer_period(&layers[i], spacing, &px, &py) ||
+        !period_matches(&layers[i], spacing, px, py, extent))
+      return False;
+    if (px)
+      tw = lcm(tw, px);
+    if (py)
+      th = lcm(th, py);
+    if (tw > MAX_TILE_SIZE || th > MAX_TILE_SIZE)
+      return False;
+  }
+  /* very narrow tiles repeat slowly, so use a few periods at once */
+  *width = tw * ((MIN_TILE_SIZE + tw - 1) / tw);
+  *height = th * ((MIN_TILE_SIZE + th - 1) / th);
+
+  /* the segments of draw_tile_diagonals must fit in an XSegment */
+  for (i = 0; i < n_layers; i++) {
+    int px, py, reach;
+
+    layer_period(&layers[i], layers[i].spacing * scale, &px, &py);
+    if (!px || !py)
+      continue;
+    reach = *height / py + 2;
+    if ((long)(*width / px + 2 * reach) * px > SHRT_MAX ||
+        (long)reach * py > SHRT_MAX)
+      return False;
+  }
+  return True;
+}
+
+/* Draw one layer of lines into a width x height tile at the origin of d,
+ * including the parts of lines from the neighbouring tiles that reach into
+ * it, so that the tile can be repeated.
+ */
+static void draw_tile_diagonals(Display *dpy, Drawable d, GC gc,
+                                const line_layer *l, double spacing,
+                                int width, int height) {
+  int px, py;
+  int reach, n = 0, j;
+
+  layer_period(l, spacing, &px, &py);
+  if (!px || !py) {
+    /* horizontal or vertical lines */
+    int period = px ? px : py;
+    int length = px ? width : height;
+    XSegment lines[length / period + 3];
+
+    for (j = -1; j <= length / period + 1; j++) {
+      if (px) {
+        lines[n].x1 = lines[n].x2 = j * px;
+        lines[n].y1 = -1;
+        lines[n].y2 = height + 1;
+      } else {
+        lines[n].y1 = lines[n].y2 = j * py;
+        lines[n].x1 = -1;
+        lines[n].x2 = width + 1;
+      }
+      n++;
     }
-    if (left_y > height) {
-      x1 = (left_y - height) / tan(theta);
-      y1 = height;
-    } else if (left_y < 0) {
-      x1 = left_y / tan(theta);
-      y1 = 0;
-    } else {
-      x1 = 0;
-      y1 = left_y;
+    XDrawSegments(dpy, d, gc, lines, n);
+    return;
+  }
+
+  /* the lines go through (j * px, 0) and step py up or down for every px
+   * across, depending on which way they lean */
+  int dy = cos(l->direction * M_PI / 180.0) > 0 ? -py : py;
+  reach = height / py + 2;
+  XSegment lines[width / px + 2 * reach + 1];
+  for (j = -reach; j <= width / px + reach; j++) {
+    lines[n].x1 = (j - reach) * px;
+    lines[n].y1 = -reach * dy;
+    lines[n].x2 = (j + reach) * px;
+    lines[n].y2 = reach * dy;
+    n++;
+  }
+  XDrawSegments(dpy, d, gc, lines, n);
+}
+
+/* Flatten every layer, with its spacing multiplied by scale, into one picture
+ * so that painting the lines costs a single composite no matter how many
+ * layers are configured. The picture is A8 when all layers are black and
+ * premultiplied ARGB32 otherwise. When the pattern repeats across a small tile
+ * only that tile is rasterized, and the picture is set to repeat; otherwise
+ * it covers the whole area inside the margins.
+ */
+static Picture overlay_picture(Display *dpy, double scale, int *tile_width,
+                               int *tile_height) {
+  int width = root_width - DIAGONATOR_LEFT_MARGIN - DIAGONATOR_RIGHT_MARGIN;
+  int height = root_height - DIAGONATOR_TOP_MARGIN - DIAGONATOR_BOTTOM_MARGIN;
+  Bool argb = False;
+  Bool tiled;
+  Pixmap pixmap, mask;
+  Picture picture, maskPicture;
+  XRenderPictureAttributes pa;
+  XRenderColor clear = {0, 0, 0, 0};
+  int i;
+
+  if (width <= 0 || height <= 0)
+    return None;
+  tiled = overlay_tile_size(scale, &width, &height);
+  *tile_width = tiled ? width : 0;
+  *tile_height = tiled ? height : 0;
+  for (i = 0; i < n_layers; i++)
+    if (layers[i].red > 0 || layers[i].green > 0 || layers[i].blue > 0)
+      argb = True;
+
+  pixmap = XCreatePixmap(dpy, root, width, height, argb ? 32 : 8);
+  label_resource(pixmap, ResOverlay, 0);
+  pa.repeat = tiled;
+  picture = XRenderCreatePicture(
+      dpy, pixmap,
+      XRenderFindStandardFormat(dpy, argb ? PictStandardARGB32 : PictStandardA8),
+      CPRepeat, &pa);
+  label_resource(picture, ResOverlay, 0);
+  XFreePixmap(dpy, pixmap);
+  XRenderFillRectangle(dpy, PictOpSrc, picture, &clear, 0, 0, width, height);
+
+  mask = XCreatePixmap(dpy, root, width, height, 1);
+  label_resource(mask, ResOverlay, 0);
+  maskPicture = XRenderCreatePicture(
+      dpy, mask, XRenderFindStandardFormat(dpy, PictStandardA1), 0, NULL);
+  label_resource(maskPicture, ResOverlay, 0);
+  for (i = 0; i < n_layers; i++) {
+    line_layer l = layers[i];
+    Picture color;
+    unsigned long valuemask = 0;
+    XGCValues values;
+    GC gc;
+
+    l.spacing *= scale;
+    values.foreground = 0;
+    valuemask |= GCForeground;
+    values.line_style = l.style;
+    valuemask |= GCLineStyle;
+    values.line_width = l.width;
+    valuemask |= GCLineWidth;
+    gc = XCreateGC(dpy, mask, valuemask, &values);
+    if (l.n_dashes)
+      XSetDashes(dpy, gc, 0, l.dashes, l.n_dashes);
+    XFillRectangle(dpy, mask, gc, 0, 0, width, height);
+    XSetForeground(dpy, gc, 1);
+    if (tiled)
+      draw_tile_diagonals(dpy, mask, gc, &l, l.spacing, width, height);
+    else
+      draw_diagonals(dpy, mask, gc, &l, width, height);
+    XFreeGC(dpy, gc);
+
+    color = solid_picture(dpy, True, l.alpha, l.red, l.green, l.blue);
+    XRenderComposite(dpy, PictOpOver, color, maskPicture, picture, 0, 0, 0, 0,
+                     0, 0, width, height);
+    XRenderFreePicture(dpy, color);
+  }
+  XRenderFreePicture(dpy, maskPicture);
+  XFreePixmap(dpy, mask);
+  return picture;
+}
+
+/* Rasterize every density level that fits in a tile up front, so switching
+ * levels never has to draw anything. Levels that need a picture as large as
+ * the screen are only built when they are first shown.
+ */
+static void build_overlay_levels(Display *dpy) {
+  int i;
+
+  for (i = 0; i < n_overlay_levels; i++) {
+    overlay_level *ol = &overlayLevels[i];
+    double scale = 1;
+    int tw, th;
+
+    if (ol->picture)
+      continue;
+    if (layers[0].spacing > 0)
+      scale = ol->spacing / layers[0].spacing;
+    if (i == overlayLevel || overlay_tile_size(scale, &tw, &th))
+      ol->picture =
+          overlay_picture(dpy, scale, &ol->tile_width, &ol->tile_height);
+  }
+}
+
+static void free_overlay_levels(Display *dpy) {
+  int i;
+
+  for (i = 0; i < n_overlay_levels; i++) {
+    if (overlayLevels[i].picture) {
+      XRenderFreePicture(dpy, overlayLevels[i].picture);
+      overlayLevels[i].picture = None;
     }
-    double right_y = left_y - width * tan(theta);
-    if (right_y < 0) {
-      x2 = width + right_y / tan(theta);
-      y2 = 0;
-    } else if (right_y > height) {
-      x2 = width + (right_y - height) / tan(theta);
-      y2 = height;
-    } else {
-      x2 = width;
-      y2 = right_y;
+  }
+}
+
+/* Parse a comma-separated list of spacings such as "50,35,20" */
+static Bool parse_spacing_levels(const char *s) {
+  n_overlay_levels = 0;
+  while (*s) {
+    char *end;
+    double spacing = strtod(s, &end);
+
+    if (end == s || spacing <= 0)
+      return False;
+    overlayLevels = realloc(overlayLevels,
+                            (n_overlay_levels + 1) * sizeof(overlay_level));
+    overlayLevels[n_overlay_levels].spacing = spacing;
+    overlayLevels[n_overlay_levels].picture = None;
+    n_overlay_levels++;
+    s = end;
+    if (*s == ',')
+      s++;
+    else if (*s)
+      return False;
+  }
+  return True;
+}
+
+/* Parse a colour given as #AARRGGBB or #RRGGBB into premultiplied components */
+static Bool parse_color(const char *s, line_layer *l) {
+  unsigned long v;
+  char *end;
+  size_t len;
+
+  if (*s == '#')
+    s++;
+  len = strlen(s);
+  if (len != 6 && len != 8)
+    return False;
+  v = strtoul(s, &end, 16);
+  if (*end)
+    return False;
+  if (len == 6)
+    v |= 0xff000000;
+  l->alpha = ((v >> 24) & 0xff) / 255.0;
+  l->red = ((v >> 16) & 0xff) / 255.0 * l->alpha;
+  l->green = ((v >> 8) & 0xff) / 255.0 * l->alpha;
+  l->blue = (v & 0xff) / 255.0 * l->alpha;
+  return True;
+}
+
+/* Parse a colon-separated dash list such as "10:5" */
+static Bool parse_dashes(const char *s, line_layer *l) {
+  l->n_dashes = 0;
+  while (*s) {
+    char *end;
+    long d = strtol(s, &end, 10);
+
+    if (end == s || d < 1 || d > 255 || l->n_dashes == MAX_DASHES)
+      return False;
+    l->dashes[l->n_dashes++] = d;
+    s = end;
+    if (*s == ':')
+      s++;
+    else if (*s)
+      return False;
+  }
+  return True;
+}
+
+/* Parse a --layer specification such as "direction=150,color=#80ff0000".
+ * Keys that are not given keep the values already in l.
+ */
+static Bool parse_layer(const char *spec, line_layer *l) {
+  char *copy = strdup(spec);
+  char *save = NULL;
+  char *key;
+  Bool ok = True;
+
+  for (key = strtok_r(copy, ",", &save); key && ok;
+       key = strtok_r(NULL, ",", &save)) {
+    char *value = strchr(key, '=');
+
+    if (!value) {
+      ok = False;
+      break;
     }
+    *value++ = '\0';
+    if (!strcmp(key, "direction"))
+      l->direction = atof(value);
+    else if (!strcmp(key, "width"))
+      l->width = atoi(value);
+    else if (!strcmp(key, "spacing"))
+      l->spacing = atof(value);
+    else if (!strcmp(key, "style"))
+      l->style = atoi(value);
+    else if (!strcmp(key, "color"))
+      ok = parse_color(value, l);
+    else if (!strcmp(key, "dashes"))
+      ok = parse_dashes(value, l);
+    else
+      ok = False;
+  }
+  free(copy);
+  return ok;
+}
+
+/* Look up the _NET_WM_WINDOW_TYPE atoms for type names given on the command
+ * line, where "dock" means _NET_WM_WINDOW_TYPE_DOCK.
+ */
+static Atom *window_type_atoms(Display *dpy, char **names, int n) {
+  Atom *atoms = malloc((n ? n : 1) * sizeof(Atom));
+  int i;
+
+  for (i = 0; i < n; i++) {
+    char name[256];
+    char *c;
 
-    lines[i].x1 = x1 + left;
-    lines[i].y1 = y1 + top;
-    lines[i].x2 = x2 + left;
-    lines[i].y2 = y2 + top;
+    snprintf(name, sizeof(name), "_NET_WM_WINDOW_TYPE_%s", names[i]);
+    for (c = name; *c; c++)
+      *c = toupper((unsigned char)*c);
+    atoms[i] = XInternAtom(dpy, name, False);
   }
-  XDrawSegments(dpy, pixmap, gc, lines, line_count);
-  XFreeGC(dpy, gc);
+  return atoms;
 }
 
 typedef enum {
@@ -1918,6 +4546,30 @@ typedef enum {
   DiagonatorLineWidth,
   DiagonatorLineSpacing,
   DiagonatorLineStyle,
+  DiagonatorLineColor,
+  DiagonatorLineDashes,
+  DiagonatorLayer,
+  DiagonatorLineFadeTime,
+  DiagonatorLineSpacingLevels,
+  DiagonatorLineScrollSpeed,
+  DiagonatorLineScrollFps,
+  DiagonatorStats,
+  DiagonatorExcludeClass,
+  DiagonatorExcludeType,
+  DiagonatorLinesBelow,
+  DiagonatorCacheBackground,
+  DiagonatorShadowCache,
+  DiagonatorDamageLevel,
+  DiagonatorDamageMaxRects,
+  DiagonatorDamageMergeDistance,
+  DiagonatorDamageMaxWaste,
+  DiagonatorShadowThreads,
+  DiagonatorRecord,
+  DiagonatorStatsPage,
+  DiagonatorTraceFile,
+  DiagonatorTraceEvents,
+  DiagonatorLatency,
+  DiagonatorResources,
   DiagonatorTopMargin,
   DiagonatorBottomMargin,
   DiagonatorLeftMargin,
@@ -1935,11 +4587,19 @@ int main(int argc, char **argv) {
   XRectangle *expose_rects = NULL;
   int size_expose = 0;
   int n_expose = 0;
-  struct pollfd ufd;
+  struct pollfd ufd[2];
   int p;
+  uint64_t traced;
   int composite_major, composite_minor;
   char *display = NULL;
   int o;
+  char **layer_specs = NULL;
+  int n_layer_specs = 0;
+  char **exclude_type_names = NULL;
+  char **lines_below_names = NULL;
+  const char *record_path = NULL;
+  Bool nonempty_damage = False; /* --damage-level nonempty was given */
+  const char *stats_page_path = NULL;
 
   static int option_flag = 0;
   static struct option long_options[] = {
@@ -1948,6 +4608,41 @@ int main(int argc, char **argv) {
       {"line-width", required_argument, &option_flag, DiagonatorLineWidth},
       {"line-spacing", required_argument, &option_flag, DiagonatorLineSpacing},
       {"line-style", required_argument, &option_flag, DiagonatorLineStyle},
+      {"line-color", required_argument, &option_flag, DiagonatorLineColor},
+      {"line-dashes", required_argument, &option_flag, DiagonatorLineDashes},
+      {"layer", required_argument, &option_flag, DiagonatorLayer},
+      {"line-fade-time", required_argument, &option_flag,
+       DiagonatorLineFadeTime},
+      {"line-spacing-levels", required_argument, &option_flag,
+       DiagonatorLineSpacingLevels},
+      {"line-scroll-speed", required_argument, &option_flag,
+       DiagonatorLineScrollSpeed},
+      {"line-scroll-fps", required_argument, &option_flag,
+       DiagonatorLineScrollFps},
+      {"stats", required_argument, &option_flag, DiagonatorStats},
+      {"exclude-class", required_argument, &option_flag,
+       DiagonatorExcludeClass},
+      {"exclude-type", required_argument, &option_flag, DiagonatorExcludeType},
+      {"lines-below", required_argument, &option_flag, DiagonatorLinesBelow},
+      {"cache-background", no_argument, &option_flag,
+       DiagonatorCacheBackground},
+      {"shadow-cache", required_argument, &option_flag, DiagonatorShadowCache},
+      {"damage-level", required_argument, &option_flag, DiagonatorDamageLevel},
+      {"damage-max-rects", required_argument, &option_flag,
+       DiagonatorDamageMaxRects},
+      {"damage-merge-distance", required_argument, &option_flag,
+       DiagonatorDamageMergeDistance},
+      {"damage-max-waste", required_argument, &option_flag,
+       DiagonatorDamageMaxWaste},
+      {"shadow-threads", required_argument, &option_flag,
+       DiagonatorShadowThreads},
+      {"record", required_argument, &option_flag, DiagonatorRecord},
+      {"stats-page", required_argument, &option_flag, DiagonatorStatsPage},
+      {"trace-file", required_argument, &option_flag, DiagonatorTraceFile},
+      {"trace-events", required_argument, &option_flag,
+       DiagonatorTraceEvents},
+      {"latency", no_argument, &option_flag, DiagonatorLatency},
+      {"resources", required_argument, &option_flag, DiagonatorResources},
       {"top-margin", required_argument, &option_flag, DiagonatorTopMargin},
       {"bottom-margin", required_argument, &option_flag,
        DiagonatorBottomMargin},
@@ -1973,6 +4668,94 @@ int main(int argc, char **argv) {
       case DiagonatorLineStyle:
         DIAGONATOR_LINE_STYLE = atoi(optarg);
         break;
+      case DiagonatorLineColor:
+        DIAGONATOR_LINE_COLOR = optarg;
+        break;
+      case DiagonatorLineDashes:
+        DIAGONATOR_LINE_DASHES = optarg;
+        break;
+      case DiagonatorLayer:
+        layer_specs =
+            realloc(layer_specs, (n_layer_specs + 1) * sizeof(char *));
+        layer_specs[n_layer_specs++] = optarg;
+        break;
+      case DiagonatorLineFadeTime:
+        DIAGONATOR_FADE_TIME = atoi(optarg);
+        break;
+      case DiagonatorLineSpacingLevels:
+        DIAGONATOR_LINE_SPACING_LEVELS = optarg;
+        break;
+      case DiagonatorLineScrollSpeed:
+        DIAGONATOR_SCROLL_SPEED = atof(optarg);
+        break;
+      case DiagonatorLineScrollFps:
+        DIAGONATOR_SCROLL_FPS = atoi(optarg);
+        if (DIAGONATOR_SCROLL_FPS < 1)
+          DIAGONATOR_SCROLL_FPS = 30;
+        break;
+      case DiagonatorStats:
+        statsInterval = atof(optarg) * 1000;
+        break;
+      case DiagonatorExcludeClass:
+        excludeClasses =
+            realloc(excludeClasses, (n_exclude_classes + 1) * sizeof(char *));
+        excludeClasses[n_exclude_classes++] = optarg;
+        break;
+      case DiagonatorExcludeType:
+        exclude_type_names = realloc(exclude_type_names,
+                                     (n_exclude_types + 1) * sizeof(char *));
+        exclude_type_names[n_exclude_types++] = optarg;
+        break;
+      case DiagonatorLinesBelow:
+        lines_below_names = realloc(lines_below_names,
+                                    (n_lines_below_types + 1) * sizeof(char *));
+        lines_below_names[n_lines_below_types++] = optarg;
+        break;
+      case DiagonatorCacheBackground:
+        cacheBackground = True;
+        break;
+      case DiagonatorShadowCache:
+        shadowCacheLimit = atof(optarg) * (1 << 20);
+        break;
+      case DiagonatorDamageLevel:
+        if (!strcmp(optarg, "nonempty"))
+          damageLevel = XDamageReportNonEmpty;
+        else if (!strcmp(optarg, "delta"))
+          damageLevel = XDamageReportDeltaRectangles;
+        else
+          usage(argv[0], 1);
+        nonempty_damage = damageLevel == XDamageReportNonEmpty;
+        break;
+      case DiagonatorDamageMaxRects:
+        damageMaxRects = atoi(optarg);
+        break;
+      case DiagonatorDamageMergeDistance:
+        damageMergeDistance = atoi(optarg);
+        break;
+      case DiagonatorDamageMaxWaste:
+        damageMaxWaste = atof(optarg);
+        break;
+      case DiagonatorShadowThreads:
+        shadowThreads = atoi(optarg);
+        break;
+      case DiagonatorRecord:
+        record_path = optarg;
+        break;
+      case DiagonatorStatsPage:
+        stats_page_path = optarg;
+        break;
+      case DiagonatorTraceFile:
+        tracePath = optarg;
+        break;
+      case DiagonatorTraceEvents:
+        traceSize = atoi(optarg);
+        break;
+      case DiagonatorLatency:
+        latencyProbe = True;
+        break;
+      case DiagonatorResources:
+        resourceInterval = atof(optarg) * 1000;
+        break;
       case DiagonatorTopMargin:
         DIAGONATOR_TOP_MARGIN = atoi(optarg);
         break;
@@ -2053,11 +4836,57 @@ int main(int argc, char **argv) {
     }
   }
 
+  /* only delta rectangles are known on this side, whatever the order of
+   * the options, and a recording needs every damaged rectangle rather than
+   * the first damage of each frame */
+  if (damageMaxRects > 0 || record_path) {
+    if (nonempty_damage)
+      usage(argv[0], 1);
+    damageLevel = XDamageReportDeltaRectangles;
+  }
+
+  /* the --line-* options describe the first layer; every --layer starts out
+   * as a copy of it */
+  n_layers = 1 + n_layer_specs;
+  layers = malloc(n_layers * sizeof(line_layer));
+  layers[0].direction = DIAGONATOR_LINE_DIRECTION;
+  layers[0].width = DIAGONATOR_LINE_WIDTH;
+  layers[0].spacing = DIAGONATOR_LINE_SPACING;
+  layers[0].style = DIAGONATOR_LINE_STYLE;
+  if (!parse_color(DIAGONATOR_LINE_COLOR, &layers[0])) {
+    fprintf(stderr, "Invalid line color %s\n", DIAGONATOR_LINE_COLOR);
+    exit(1);
+  }
+  if (!parse_dashes(DIAGONATOR_LINE_DASHES, &layers[0])) {
+    fprintf(stderr, "Invalid line dashes %s\n", DIAGONATOR_LINE_DASHES);
+    exit(1);
+  }
+  for (i = 0; i < n_layer_specs; i++) {
+    layers[i + 1] = layers[0];
+    if (!parse_layer(layer_specs[i], &layers[i + 1])) {
+      fprintf(stderr, "Invalid layer %s\n", layer_specs[i]);
+      exit(1);
+    }
+  }
+  free(layer_specs);
+  if (!parse_spacing_levels(DIAGONATOR_LINE_SPACING_LEVELS)) {
+    fprintf(stderr, "Invalid line spacing levels %s\n",
+            DIAGONATOR_LINE_SPACING_LEVELS);
+    exit(1);
+  }
+  if (!n_overlay_levels) {
+    overlayLevels = malloc(sizeof(overlay_level));
+    overlayLevels[0].spacing = layers[0].spacing;
+    overlayLevels[0].picture = None;
+    n_overlay_levels = 1;
+  }
+
   dpy = XOpenDisplay(display);
   if (!dpy) {
     fprintf(stderr, "Can't open display\n");
     exit(1);
   }
+  xcb = XGetXCBConnection(dpy);
   XSetErrorHandler(error);
   if (synchronize)
     XSynchronize(dpy, 1);
@@ -2095,6 +4924,17 @@ int main(int argc, char **argv) {
   if (!register_cm(dpy)) {
     exit(1);
   }
+  if (stats_page_path)
+    open_stats_page(stats_page_path);
+  if (resourceInterval) {
+    int event, error;
+    hasXRes = XResQueryExtension(dpy, &event, &error);
+    for (i = 0; i < NumResourceTypes; i++)
+      resourceTypeAtoms[i] = XInternAtom(dpy, resourceTypeNames[i], False);
+    resources_time = get_time_in_milliseconds() + resourceInterval;
+  }
+  if (statsInterval || statsPage || resourceInterval)
+    account_requests(dpy);
 
   /* get atoms */
   opacityAtom = XInternAtom(dpy, OPACITY_PROP, False);
@@ -2107,12 +4947,32 @@ int main(int argc, char **argv) {
   winSplashAtom = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE_SPLASH", False);
   winDialogAtom = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE_DIALOG", False);
   winNormalAtom = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE_NORMAL", False);
+  overlayOpacityAtom = XInternAtom(dpy, OVERLAY_OPACITY_PROP, False);
+  overlayLevelAtom = XInternAtom(dpy, OVERLAY_LEVEL_PROP, False);
+  latencyAtom = XInternAtom(dpy, LATENCY_PROP, False);
+  excludeTypes = window_type_atoms(dpy, exclude_type_names, n_exclude_types);
+  free(exclude_type_names);
+  linesBelowTypes =
+      window_type_atoms(dpy, lines_below_names, n_lines_below_types);
+  free(lines_below_names);
+
+  overlayOpacity = overlayTarget = get_overlay_opacity(dpy);
+  overlayLevel = get_overlay_level(dpy);
+  scroll_start = scroll_time = get_time_in_milliseconds();
+  stats_start = scroll_start;
+  stats_time = scroll_start + statsInterval;
+  start_trace();
 
   pa.subwindow_mode = IncludeInferiors;
 
   if (compMode == CompClientShadows) {
-    gaussianMap = make_gaussian_map(dpy, shadowRadius);
-    presum_gaussian(gaussianMap);
+    gaussianMap = make_gaussian_map(shadowRadius);
+    shadowTables = presum_gaussian(gaussianMap);
+    if (!shadowTables) {
+      fprintf(stderr, "Not enough memory for the shadows\n");
+      exit(1);
+    }
+    start_shadow_workers();
   }
 
   root_width = DisplayWidth(dpy, scr);
@@ -2121,6 +4981,7 @@ int main(int argc, char **argv) {
   rootPicture = XRenderCreatePicture(
       dpy, root, XRenderFindVisualFormat(dpy, DefaultVisual(dpy, scr)),
       CPSubwindowMode, &pa);
+  label_resource(rootPicture, ResRoot, 0);
   blackPicture = solid_picture(dpy, True, 1, 0, 0, 0);
   if (compMode == CompServerShadows)
     transBlackPicture = solid_picture(dpy, True, 0.3, 0, 0, 0);
@@ -2136,21 +4997,17 @@ int main(int argc, char **argv) {
                      PropertyChangeMask);
     XShapeSelectInput(dpy, root, ShapeNotifyMask);
     XQueryTree(dpy, root, &root_return, &parent_return, &children, &nchildren);
-    for (i = 0; i < nchildren; i++)
-      add_win(dpy, children[i], i ? children[i - 1] : None);
+    add_wins(dpy, children, nchildren);
     XFree(children);
   }
   XUngrabServer(dpy);
+  if (record_path)
+    start_recording(record_path);
 
-  Pixmap overlay_pixmap = XCreatePixmap(dpy, root, root_width, root_height, 1);
-  draw_diagonals(dpy, overlay_pixmap);
-  overlayPicture = XRenderCreatePicture(
-      dpy, overlay_pixmap, XRenderFindStandardFormat(dpy, PictStandardA1), 0,
-      &pa);
-  XFreePixmap(dpy, overlay_pixmap);
-
-  ufd.fd = ConnectionNumber(dpy);
-  ufd.events = POLLIN;
+  ufd[0].fd = ConnectionNumber(dpy);
+  ufd[0].events = POLLIN;
+  ufd[1].fd = shadowPipe[0];
+  ufd[1].events = POLLIN;
   if (!autoRedirect)
     paint_all(dpy, None);
   for (;;) {
@@ -2159,19 +5016,29 @@ int main(int argc, char **argv) {
       if (autoRedirect)
         XFlush(dpy);
       if (!QLength(dpy)) {
-        if (poll(&ufd, 1, fade_timeout()) == 0) {
+        int ready = poll(ufd, shadowPipe[0] < 0 ? 1 : 2, next_timeout());
+        if (ready > 0 && shadowPipe[0] >= 0 && (ufd[1].revents & POLLIN))
+          collect_shadows(dpy);
+        if (ready <= 0 || !(ufd[0].revents & POLLIN)) {
           run_fades(dpy);
+          run_scroll(dpy);
+          run_stats();
+          run_resources(dpy);
           break;
         }
       }
 
       XNextEvent(dpy, &ev);
+      traced = trace_clock();
+      pageStats.events[ev.type & 0x7f]++;
       if ((ev.type & 0x7f) != KeymapNotify)
         discard_ignore(dpy, ev.xany.serial);
 #if DEBUG_EVENTS
       printf("event %10.10s serial 0x%08x window 0x%08x\n", ev_name(&ev),
              ev_serial(&ev), ev_window(&ev));
 #endif
+      if (recordFile)
+        record_event(dpy, &ev);
       if (!autoRedirect)
         switch (ev.type) {
         case CreateNotify:
@@ -2230,30 +5097,45 @@ int main(int argc, char **argv) {
                 XClearArea(dpy, root, 0, 0, 0, 0, True);
                 XRenderFreePicture(dpy, rootTile);
                 rootTile = None;
+                free_background(dpy);
                 break;
               }
             }
           }
+          if (ev.xproperty.window == root &&
+              ev.xproperty.atom == overlayOpacityAtom)
+            set_overlay_opacity(dpy, get_overlay_opacity(dpy));
+          if (ev.xproperty.window == root &&
+              ev.xproperty.atom == overlayLevelAtom)
+            set_overlay_level(dpy, get_overlay_level(dpy));
+          if (latencyProbe && ev.xproperty.atom == latencyAtom)
+            stamp_win(dpy, ev.xproperty.window);
           /* check if Trans property was changed */
           if (ev.xproperty.atom == opacityAtom) {
             /* reset mode and redraw window */
             win *w = find_win(dpy, ev.xproperty.window);
             if (w) {
+              unsigned int opacity = get_opacity_prop(dpy, w, OPAQUE);
+
+              if (recordFile)
+                record_opacity(w, opacity);
               if (fadeTrans) {
                 double start, finish, step;
                 start = w->opacity * 1.0 / OPAQUE;
-                finish = get_opacity_percent(dpy, w, 1.0);
+                finish = opacity * 1.0 / OPAQUE;
                 if (start > finish)
                   step = fade_in_step;
                 else
                   step = fade_out_step;
                 set_fade(dpy, w, start, finish, step, NULL, False, True, False);
               } else {
-                w->opacity = get_opacity_prop(dpy, w, OPAQUE);
+                w->opacity = opacity;
                 determine_mode(dpy, w);
                 if (w->shadow) {
                   XRenderFreePicture(dpy, w->shadow);
                   w->shadow = None;
+                  if (w->extents)
+                    free_region(dpy, w->extents);
                   w->extents = win_extents(dpy, w);
                 }
               }
@@ -2268,14 +5150,66 @@ int main(int argc, char **argv) {
           }
           break;
         }
+      trace(TraceEvent, traced, ev.type);
     } while (QLength(dpy));
+    if (recordFile)
+      fflush(recordFile);
+    if (configurePending) {
+      traced = trace_clock();
+      flush_configures(dpy);
+      trace(TraceFlushConfigures, traced, 0);
+    }
+    if (damagePending) {
+      traced = trace_clock();
+      flush_damage(dpy);
+      trace(TraceFlushDamage, traced, 0);
+    }
     if (allDamage && !autoRedirect) {
       static int paint;
+      unsigned long request;
+      Bool measure = statsInterval || statsPage;
+      double cpu = statsInterval ? cpu_time() : 0;
+      double wall;
+      /* let the server finish the previous frame before sending another,
+       * without waiting for it while handling events */
+      if (fencePending) {
+        uint64_t traced = round_trip();
+        free(xcb_get_input_focus_reply(xcb, frameFence, NULL));
+        trace(TraceRoundTrip, traced, 0);
+        fencePending = False;
+      }
+      wall = measure ? wall_time() : 0;
+      request = NextRequest(dpy);
       paint_all(dpy, allDamage);
       paint++;
-      XSync(dpy, False);
+      frameFence = xcb_get_input_focus(xcb);
+      fencePending = True;
+      sync_sequence(dpy);
+      XFlush(dpy);
+      if (measure)
+        wall = wall_time() - wall;
+      if (statsInterval)
+        count_frame(cpu_time() - cpu, wall, NextRequest(dpy) - request);
+      pageStats.frames++;
+      pageStats.paint_us[paint_bucket(wall * 1e6)]++;
+      if (latencyProbe) {
+        /* the frame is only on the screen once the server has got to the
+         * fence */
+        uint64_t traced = round_trip();
+        free(xcb_get_input_focus_reply(xcb, frameFence, NULL));
+        trace(TraceRoundTrip, traced, 0);
+        fencePending = False;
+        count_latencies();
+      }
       allDamage = None;
       clipChanged = False;
+      scrollFrame = False;
+      /* the poll timeout may never expire while damage keeps coming */
+      run_stats();
+      run_resources(dpy);
     }
+    publish_stats();
+    if (traceDumpRequested)
+      dump_trace();
   }
 }